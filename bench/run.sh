@@ -0,0 +1,292 @@
+#!/usr/bin/env bash
+#
+# Times byol on a set of generated workloads, printing the best user+sys CPU
+# seconds out of several runs for each binary, evaluator and workload.
+#
+# Usage: bench/run.sh [-n runs] [-w workload[,workload...]] [binary...]
+#
+# Binaries default to bin/byol. Pass several, e.g. builds with different
+# flags or from different commits, to compare them side by side. To see what
+# huge pages buy, build a second binary with -DLALLOC_HUGE and run
+#
+#   bench/run.sh -w bigheap,boxed bin/byol bin/byol-huge
+#
+# Where perf can count dTLB-load-misses, each binary also gets a column with
+# the misses of one run, which is where huge pages should show first.
+#
+# Workloads:
+#   churn     short-lived expressions, mostly allocation and freeing
+#   sum       arithmetic over a list of 2^20 numbers
+#   env       defining and looking up 20k names
+#   env10, env1k, env100k, env1m
+#             defining 10 to 1M names, then looking up 1M of them. Lookups
+#             should cost the same whatever the size, so any growth should
+#             come from defining the names.
+#   join      joining copies of a 64k element list
+#   deflist   growing a list one def at a time, (def {l} (join l {1}))
+#   boxed     walking lists of numbers too big to be immediates
+#   bigheap   building, walking and dropping 256k boxed numbers, 10 times,
+#             several MB of nodes spread over many pages
+#   calls     evaluating a 700 call expression 20k times, nothing to fold
+#   fold      evaluating a body full of constant calls 20k times
+#   refold    the same, with an unrelated def before each eval
+#   evals     a chain of 50k evals, each calling the one before
+
+set -e
+
+RUNS=5
+WORKLOADS=churn,sum,env,join,deflist,boxed,bigheap,calls,fold,refold,evals
+MODES=${MODES:-"tree --vm --closures"}
+
+while getopts "n:w:" opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    w) WORKLOADS=$OPTARG ;;
+    *) exit 2 ;;
+  esac
+done
+
+shift $((OPTIND - 1))
+BINARIES=("${@:-bin/byol}")
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gen_churn() {
+  awk 'BEGIN {
+    for (i = 0; i < 20000; i++) {
+      print "(list 1 2 3 4)"
+      print "(* 3 (- 10 4))"
+      print "(join {1} (tail {1 2 3}))"
+      print "(head {1 2 3})"
+      print "(eval {+ 1 2})"
+    }
+  }'
+}
+
+gen_sum() {
+  echo "def {x} {1}"
+  for i in $(seq 20); do
+    echo "def {x} (join x x)"
+  done
+
+  for i in $(seq 30); do
+    echo "eval (join {+} x)"
+  done
+}
+
+gen_env() {
+  awk 'BEGIN {
+    for (i = 0; i < 20000; i++) {
+      print "def {v" i "} " i
+    }
+
+    for (i = 0; i < 20000; i += 10) {
+      line = "+"
+      for (j = i; j < i + 10; j++) {
+        line = line " v" j
+      }
+      print line
+    }
+  }'
+}
+
+# Defines n names, up to 1000 to a def, then sums 1M lookups spread across
+# all of them
+gen_env_scale() {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i < n; i += 1000) {
+      names = ""
+      values = ""
+      for (j = i; j < i + 1000 && j < n; j++) {
+        names = names " v" j
+        values = values " " j
+      }
+      print "def {" substr(names, 2) "}" values
+    }
+
+    for (k = 0; k < 1000000; k += 100) {
+      line = "+"
+      for (j = k; j < k + 100; j++) {
+        line = line " v" (j * 7919 % n)
+      }
+      print line
+    }
+  }'
+}
+
+gen_env10()   { gen_env_scale 10; }
+gen_env1k()   { gen_env_scale 1000; }
+gen_env100k() { gen_env_scale 100000; }
+gen_env1m()   { gen_env_scale 1000000; }
+
+gen_join() {
+  echo "def {x} {0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15}"
+  for i in $(seq 12); do
+    echo "def {x} (join x x)"
+  done
+
+  for i in $(seq 50); do
+    echo "len (join x x x x x x x x)"
+  done
+}
+
+gen_deflist() {
+  echo "def {l} {}"
+  awk 'BEGIN {
+    for (i = 0; i < 20000; i++) {
+      print "def {l} (join l {1})"
+    }
+  }'
+  echo "len l"
+}
+
+gen_boxed() {
+  echo "def {x} {4611686018427387904 4611686018427387905 4611686018427387906 4611686018427387907}"
+  for i in $(seq 15); do
+    echo "def {x} (join x x)"
+  done
+
+  for i in $(seq 50); do
+    echo "eval (join {max} x)"
+  done
+}
+
+gen_bigheap() {
+  echo "def {b} 4611686018427387904"
+  echo "def {x} {(+ b 1)}"
+  for i in $(seq 18); do
+    echo "def {x} (join x x)"
+  done
+
+  for i in $(seq 10); do
+    echo "def {y} (eval (join {list} x))"
+    echo "eval (join {max} y)"
+    echo "def {y} {}"
+  done
+}
+
+gen_calls() {
+  echo "def {x} 2"
+  awk 'BEGIN {
+    call = "(+ x (* x 3) (- 10 x) (/ 8 x) (+ (* x 2) (- 9 x)))"
+    printf "def {p} {+"
+    for (i = 0; i < 100; i++) {
+      printf " %s", call
+    }
+    print "}"
+
+    for (i = 0; i < 20000; i++) {
+      print "eval p"
+    }
+  }'
+}
+
+gen_fold() {
+  echo "def {x} 5"
+  awk 'BEGIN {
+    call = "(* 60 60 24) (/ 3600 60) (max 1 2 3) (len {1 2 3 4}) (+ x 1)"
+    printf "def {p} {+"
+    for (i = 0; i < 40; i++) {
+      printf " %s", call
+    }
+    print "}"
+
+    for (i = 0; i < 20000; i++) {
+      print "eval p"
+    }
+  }'
+}
+
+gen_refold() {
+  echo "def {x} 5"
+  awk 'BEGIN {
+    call = "(* 60 60 24) (/ 3600 60) (max 1 2 3) (len {1 2 3 4}) (+ x 1)"
+    printf "def {p} {+"
+    for (i = 0; i < 40; i++) {
+      printf " %s", call
+    }
+    print "}"
+
+    for (i = 0; i < 20000; i++) {
+      print "def {n} " i
+      print "eval p"
+    }
+  }'
+}
+
+gen_evals() {
+  awk 'BEGIN {
+    print "def {a0} {+ 1 2}"
+    for (i = 1; i < 50000; i++) {
+      print "def {a" i "} {eval a" i - 1 "}"
+    }
+    print "eval a49999"
+  }'
+}
+
+# Best user+sys CPU seconds of running binary with its arguments on input
+best_of() {
+  local input=$1
+  shift
+
+  for run in $(seq "$RUNS"); do
+    TIMEFORMAT="%3U %3S"
+    { time "$@" < "$input" > /dev/null 2>&1; } 2>> "$TMP/times"
+  done
+
+  awk 'NR == 1 || $1 + $2 < best { best = $1 + $2 } END { printf "%.3f", best }' "$TMP/times"
+  rm -f "$TMP/times"
+}
+
+# dTLB load misses of one run of binary with its arguments on input, in
+# millions
+tlb_misses() {
+  local input=$1
+  shift
+
+  perf stat -x, -e dTLB-load-misses -o "$TMP/perf" "$@" < "$input" > /dev/null 2>&1 || true
+  awk -F, '$3 ~ /^dTLB-load-misses/ && $1 ~ /^[0-9]+$/ { printf "%.2fM", $1 / 1e6; found = 1 }
+           END { if (!found) printf "-" }' "$TMP/perf"
+}
+
+# Only report misses if perf is there and the counter works, which it often
+# doesn't in containers and VMs
+PERF=
+if command -v perf > /dev/null 2>&1; then
+  echo > "$TMP/true.in"
+  if [ "$(tlb_misses "$TMP/true.in" true)" != - ]; then
+    PERF=1
+  fi
+fi
+
+printf "%-10s %-10s" workload mode
+for binary in "${BINARIES[@]}"; do
+  printf " %12s" "$(basename "$binary")"
+  if [ -n "$PERF" ]; then
+    printf " %10s" dTLB
+  fi
+done
+echo
+
+for workload in ${WORKLOADS//,/ }; do
+  "gen_$workload" > "$TMP/$workload.in"
+
+  for mode in $MODES; do
+    printf "%-10s %-10s" "$workload" "$mode"
+
+    for binary in "${BINARIES[@]}"; do
+      command=("$binary")
+      if [ "$mode" != tree ]; then
+        command+=("$mode")
+      fi
+
+      printf " %12s" "$(best_of "$TMP/$workload.in" "${command[@]}")"
+      if [ -n "$PERF" ]; then
+        printf " %10s" "$(tlb_misses "$TMP/$workload.in" "${command[@]}")"
+      fi
+    done
+
+    echo
+  done
+done
@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lalloc.h"
+
+static lalloc_stats_t stats = { 0, 0, 0 };
+static _Thread_local lalloc_array_stats_t array_stats = { 0, 0, 0, 0 };
+static _Thread_local lalloc_usage_t usage = { 0, 0, 0, 0, 0 };
+static _Thread_local int over_quota = 0;
+
+static void *lalloc_checked(void *ptr, size_t size) {
+  if (ptr == NULL && size > 0) {
+    fputs("byol: out of memory\n", stderr);
+    abort();
+  }
+
+  return ptr;
+}
+
+static void *lalloc_sys(size_t size) {
+  return lalloc_checked(malloc(size), size);
+}
+
+static void *lalloc_sys_realloc(void *ptr, size_t size) {
+  return lalloc_checked(realloc(ptr, size), size);
+}
+
+/* Live can only pass the quota by passing the peak first, so allocations
+ * get away with a single comparison */
+static void lalloc_peak() {
+  usage.peak = usage.live;
+
+  if (usage.quota > 0 && usage.live - usage.base > usage.quota && !over_quota) {
+    over_quota = 1;
+    usage.exceeded++;
+  }
+}
+
+static void lalloc_count(size_t size) {
+  usage.live += size;
+
+  if (usage.live > usage.peak) {
+    lalloc_peak();
+  }
+}
+
+static void lalloc_uncount(size_t size) {
+  usage.live -= size;
+}
+
+#ifdef LALLOC_MALLOC
+
+void *lalloc(size_t size) {
+  stats.allocs++;
+  lalloc_count(size);
+  return lalloc_sys(size);
+}
+
+void lalloc_free(void *ptr, size_t size) {
+  if (ptr != NULL) {
+    stats.frees++;
+    lalloc_uncount(size);
+    free(ptr);
+  }
+}
+
+void lalloc_free_chain(void *head, void *tail, size_t count, size_t size) {
+  while (head != NULL) {
+    void *next = *(void **) head;
+    lalloc_free(head, size);
+    head = next;
+  }
+}
+
+void lalloc_release() {
+}
+
+size_t lalloc_array_size(size_t size) {
+  return size;
+}
+
+void *lalloc_array(size_t size) {
+  array_stats.allocs++;
+  lalloc_count(size);
+  return lalloc_sys(size);
+}
+
+void *lalloc_array_realloc(void *ptr, size_t oldSize, size_t newSize) {
+  lalloc_uncount(oldSize);
+  lalloc_count(newSize);
+  return lalloc_sys_realloc(ptr, newSize);
+}
+
+void lalloc_array_free(void *ptr, size_t size) {
+  array_stats.frees++;
+  lalloc_uncount(size);
+  free(ptr);
+}
+
+void lalloc_array_release() {
+}
+
+#else
+
+#define LALLOC_ALIGN       16
+#define LALLOC_MAX_SIZE    256
+#define LALLOC_NUM_CLASSES (LALLOC_MAX_SIZE / LALLOC_ALIGN)
+#define LALLOC_PAGE_SIZE   (64 * 1024)
+
+/* Free blocks are threaded through their own memory */
+typedef struct lalloc_block {
+  struct lalloc_block *next;
+} lalloc_block_t;
+
+/* Every page starts with a header linking it to the next page, padded so the
+ * blocks that follow stay aligned */
+typedef union lalloc_page {
+  union lalloc_page *next;
+  char pad[LALLOC_ALIGN];
+} lalloc_page_t;
+
+static lalloc_block_t *free_lists[LALLOC_NUM_CLASSES];
+
+/* Unused tail of the most recent page for each class */
+static char *bump_ptr[LALLOC_NUM_CLASSES];
+static char *bump_end[LALLOC_NUM_CLASSES];
+
+/* Pages that came from malloc */
+static lalloc_page_t *pages = NULL;
+
+#ifdef LALLOC_HUGE
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define LALLOC_HUGE_PAGE  ((size_t) 2 * 1024 * 1024)
+#define LALLOC_ARENA_SIZE (32 * LALLOC_HUGE_PAGE)
+
+/* Arenas are reserved straight from the kernel, aligned to huge pages, and
+ * cut into slab pages in order. Nothing in them is freed before
+ * lalloc_release(). */
+typedef struct lalloc_arena {
+  struct lalloc_arena *next;
+  char *base;
+} lalloc_arena_t;
+
+static lalloc_arena_t *arenas = NULL;
+static char *arena_ptr = NULL;
+static char *arena_end = NULL;
+static int arenas_unavailable = 0;
+
+static int lalloc_arena_new() {
+  /* Over-reserve by a huge page so the arena can be aligned to one */
+  size_t size = LALLOC_ARENA_SIZE + LALLOC_HUGE_PAGE;
+  char *raw = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (raw == MAP_FAILED) {
+    arenas_unavailable = 1;
+    return 0;
+  }
+
+  char *base = (char *) (((uintptr_t) raw + LALLOC_HUGE_PAGE - 1) & ~(LALLOC_HUGE_PAGE - 1));
+  char *end = base + LALLOC_ARENA_SIZE;
+
+  if (base > raw) {
+    munmap(raw, base - raw);
+  }
+
+  if (raw + size > end) {
+    munmap(end, raw + size - end);
+  }
+
+  /* Only a hint: without transparent huge pages this is an ordinary
+   * mapping, which works just as well */
+#ifdef MADV_HUGEPAGE
+  madvise(base, LALLOC_ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+
+  lalloc_arena_t *arena = lalloc_sys(sizeof(lalloc_arena_t));
+  arena->base = base;
+  arena->next = arenas;
+  arenas = arena;
+
+  arena_ptr = base;
+  arena_end = end;
+  return 1;
+}
+
+static lalloc_page_t *lalloc_arena_page() {
+  if (arena_ptr == arena_end && (arenas_unavailable || !lalloc_arena_new())) {
+    return NULL;
+  }
+
+  lalloc_page_t *page = (lalloc_page_t *) arena_ptr;
+  arena_ptr += LALLOC_PAGE_SIZE;
+  return page;
+}
+
+static void lalloc_arena_release() {
+  while (arenas != NULL) {
+    lalloc_arena_t *next = arenas->next;
+    munmap(arenas->base, LALLOC_ARENA_SIZE);
+    free(arenas);
+    arenas = next;
+  }
+
+  arena_ptr = NULL;
+  arena_end = NULL;
+}
+
+#else
+
+static lalloc_page_t *lalloc_arena_page() {
+  return NULL;
+}
+
+static void lalloc_arena_release() {
+}
+
+#endif
+
+static int lalloc_class(size_t size) {
+  return (int) ((size + LALLOC_ALIGN - 1) / LALLOC_ALIGN) - 1;
+}
+
+static void *lalloc_refill(int class) {
+  size_t block_size = (size_t) (class + 1) * LALLOC_ALIGN;
+
+  lalloc_page_t *page = lalloc_arena_page();
+  if (page == NULL) {
+    page = lalloc_sys(LALLOC_PAGE_SIZE);
+    page->next = pages;
+    pages = page;
+  }
+
+  stats.pages++;
+
+  bump_ptr[class] = (char *) (page + 1);
+  bump_end[class] = (char *) page + LALLOC_PAGE_SIZE;
+
+  /* Hand out the first block straight away */
+  void *block = bump_ptr[class];
+  bump_ptr[class] += block_size;
+  return block;
+}
+
+void *lalloc(size_t size) {
+  stats.allocs++;
+
+  if (size == 0 || size > LALLOC_MAX_SIZE) {
+    lalloc_count(size);
+    return lalloc_sys(size);
+  }
+
+  int class = lalloc_class(size);
+  size_t block_size = (size_t) (class + 1) * LALLOC_ALIGN;
+  lalloc_count(block_size);
+
+  /* Prefer recycled blocks */
+  lalloc_block_t *block = free_lists[class];
+  if (block != NULL) {
+    free_lists[class] = block->next;
+    return block;
+  }
+
+  /* Then whatever is left of the current page */
+  if (bump_ptr[class] != NULL && bump_ptr[class] + block_size <= bump_end[class]) {
+    void *ptr = bump_ptr[class];
+    bump_ptr[class] += block_size;
+    return ptr;
+  }
+
+  return lalloc_refill(class);
+}
+
+void lalloc_free(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  stats.frees++;
+
+  if (size == 0 || size > LALLOC_MAX_SIZE) {
+    lalloc_uncount(size);
+    free(ptr);
+    return;
+  }
+
+  int class = lalloc_class(size);
+  lalloc_uncount((size_t) (class + 1) * LALLOC_ALIGN);
+
+  lalloc_block_t *block = ptr;
+  block->next = free_lists[class];
+  free_lists[class] = block;
+}
+
+void lalloc_free_chain(void *head, void *tail, size_t count, size_t size) {
+  if (head == NULL) {
+    return;
+  }
+
+  if (size == 0 || size > LALLOC_MAX_SIZE) {
+    while (head != NULL) {
+      void *next = *(void **) head;
+      lalloc_free(head, size);
+      head = next;
+    }
+
+    return;
+  }
+
+  /* The chain is already linked the way the free list is */
+  int class = lalloc_class(size);
+  ((lalloc_block_t *) tail)->next = free_lists[class];
+  free_lists[class] = head;
+  stats.frees += count;
+  lalloc_uncount(count * (class + 1) * LALLOC_ALIGN);
+}
+
+#define LALLOC_ARRAY_MIN_SHIFT   6  /* 64 bytes */
+#define LALLOC_ARRAY_MAX_SHIFT   16 /* 64KB */
+#define LALLOC_ARRAY_NUM_CLASSES (LALLOC_ARRAY_MAX_SHIFT - LALLOC_ARRAY_MIN_SHIFT + 1)
+
+/* How much each class may keep cached before frees go back to libc */
+#define LALLOC_ARRAY_CACHE_BYTES (256 * 1024)
+
+/* Per-thread caches, so no locking is ever needed */
+static _Thread_local lalloc_block_t *array_cache[LALLOC_ARRAY_NUM_CLASSES];
+static _Thread_local size_t array_cached[LALLOC_ARRAY_NUM_CLASSES];
+
+/* The smallest class that fits size, or -1 if none does */
+static int lalloc_array_class(size_t size) {
+  int shift = LALLOC_ARRAY_MIN_SHIFT;
+  while (((size_t) 1 << shift) < size) {
+    shift++;
+  }
+
+  return shift > LALLOC_ARRAY_MAX_SHIFT ? -1 : shift - LALLOC_ARRAY_MIN_SHIFT;
+}
+
+size_t lalloc_array_size(size_t size) {
+  int class = lalloc_array_class(size);
+  return class < 0 ? size : (size_t) 1 << (class + LALLOC_ARRAY_MIN_SHIFT);
+}
+
+void *lalloc_array(size_t size) {
+  array_stats.allocs++;
+
+  int class = lalloc_array_class(size);
+  if (class < 0) {
+    lalloc_count(size);
+    return lalloc_sys(size);
+  }
+
+  size_t block_size = (size_t) 1 << (class + LALLOC_ARRAY_MIN_SHIFT);
+  lalloc_count(block_size);
+
+  lalloc_block_t *block = array_cache[class];
+  if (block != NULL) {
+    array_cache[class] = block->next;
+    array_cached[class]--;
+    array_stats.reused++;
+    array_stats.cachedBytes -= block_size;
+    return block;
+  }
+
+  return lalloc_sys(block_size);
+}
+
+/* Arrays that stay within their class keep their block */
+void *lalloc_array_realloc(void *ptr, size_t oldSize, size_t newSize) {
+  int oldClass = lalloc_array_class(oldSize);
+  int newClass = lalloc_array_class(newSize);
+
+  if (oldClass >= 0 && oldClass == newClass) {
+    return ptr;
+  }
+
+  if (oldClass < 0 && newClass < 0) {
+    lalloc_uncount(oldSize);
+    lalloc_count(newSize);
+    return lalloc_sys_realloc(ptr, newSize);
+  }
+
+  void *grown = lalloc_array(newSize);
+  memcpy(grown, ptr, oldSize < newSize ? oldSize : newSize);
+  lalloc_array_free(ptr, oldSize);
+  return grown;
+}
+
+void lalloc_array_free(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  array_stats.frees++;
+
+  int class = lalloc_array_class(size);
+  if (class < 0) {
+    lalloc_uncount(size);
+    free(ptr);
+    return;
+  }
+
+  size_t block_size = (size_t) 1 << (class + LALLOC_ARRAY_MIN_SHIFT);
+  lalloc_uncount(block_size);
+
+  if ((array_cached[class] + 1) * block_size > LALLOC_ARRAY_CACHE_BYTES) {
+    free(ptr);
+    return;
+  }
+
+  lalloc_block_t *block = ptr;
+  block->next = array_cache[class];
+  array_cache[class] = block;
+  array_cached[class]++;
+  array_stats.cachedBytes += block_size;
+}
+
+void lalloc_array_release() {
+  for (int i = 0; i < LALLOC_ARRAY_NUM_CLASSES; i++) {
+    while (array_cache[i] != NULL) {
+      lalloc_block_t *next = array_cache[i]->next;
+      free(array_cache[i]);
+      array_cache[i] = next;
+    }
+
+    array_cached[i] = 0;
+  }
+
+  array_stats.cachedBytes = 0;
+}
+
+/* Return every page to libc in one go, along with the calling thread's
+ * cached arrays. Only safe once all slab-allocated objects are dead, e.g.
+ * after the environment has been deleted. */
+void lalloc_release() {
+  lalloc_array_release();
+
+  while (pages != NULL) {
+    lalloc_page_t *next = pages->next;
+    free(pages);
+    pages = next;
+  }
+
+  lalloc_arena_release();
+
+  for (int i = 0; i < LALLOC_NUM_CLASSES; i++) {
+    free_lists[i] = NULL;
+    bump_ptr[i] = NULL;
+    bump_end[i] = NULL;
+  }
+
+  stats.pages = 0;
+}
+
+#endif
+
+void *lalloc_raw(size_t size) {
+  lalloc_count(size);
+  return lalloc_sys(size);
+}
+
+void lalloc_raw_free(void *ptr, size_t size) {
+  if (ptr != NULL) {
+    lalloc_uncount(size);
+    free(ptr);
+  }
+}
+
+void lalloc_account(ptrdiff_t bytes) {
+  if (bytes < 0) {
+    lalloc_uncount((size_t) -bytes);
+  } else {
+    lalloc_count((size_t) bytes);
+  }
+}
+
+void lalloc_quota_begin(size_t quota) {
+  usage.base = usage.live;
+  usage.peak = usage.live;
+  usage.quota = quota;
+  over_quota = 0;
+}
+
+int lalloc_quota_exceeded() {
+  return over_quota;
+}
+
+lalloc_usage_t lalloc_usage() {
+  return usage;
+}
+
+lalloc_stats_t lalloc_stats() {
+  return stats;
+}
+
+lalloc_array_stats_t lalloc_array_stats() {
+  return array_stats;
+}
@@ -0,0 +1,90 @@
+/*
+ * Size-class slab allocator for interpreter objects.
+ *
+ * Small objects (lval_t nodes and friends) are carved out of fixed-size pages
+ * and recycled through one free list per size class, so building and
+ * deleting values doesn't round-trip through malloc/free. Pages are only
+ * handed back to libc in bulk by lalloc_release().
+ *
+ * Variable-sized arrays (list cell blocks) get their own pools instead, one
+ * per power-of-two size from 64 bytes to 64KB. lalloc_array_size() says how
+ * big the block backing a request really is, so callers can use all of it.
+ * Freed arrays are cached per thread, up to a fixed amount per size, and
+ * reused before anything new is asked of libc. Bigger arrays go straight to
+ * malloc.
+ *
+ * Compile with -DLALLOC_HUGE to take slab pages from 64MB arenas mapped
+ * with mmap() and advised to use transparent huge pages, so a big heap of
+ * nodes needs far fewer TLB entries. Where that isn't possible pages come
+ * from malloc as usual.
+ *
+ * Every byte handed out is counted, so an evaluation can be held to a
+ * quota, and running out of memory is fatal rather than a NULL to check.
+ *
+ * Compile with -DLALLOC_MALLOC to bypass the slabs and pools and use plain
+ * malloc/free, which keeps tools like valgrind and ASan useful when
+ * debugging.
+ */
+
+#include <stddef.h>
+
+typedef struct {
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long pages;
+} lalloc_stats_t;
+
+void *lalloc(size_t size);
+void lalloc_free(void *ptr, size_t size);
+
+/* Frees count objects of the same size at once. They are chained through
+ * their first word, from head to tail, so a thread that isn't allowed to
+ * call lalloc_free() can still do the work of collecting them. */
+void lalloc_free_chain(void *head, void *tail, size_t count, size_t size);
+void lalloc_release();
+
+lalloc_stats_t lalloc_stats();
+
+/* Counts for the calling thread */
+typedef struct {
+  unsigned long allocs;
+  unsigned long reused; /* allocs served from the cache */
+  unsigned long frees;
+  size_t cachedBytes;
+} lalloc_array_stats_t;
+
+size_t lalloc_array_size(size_t size);
+void *lalloc_array(size_t size);
+void *lalloc_array_realloc(void *ptr, size_t oldSize, size_t newSize);
+void lalloc_array_free(void *ptr, size_t size);
+
+/* Hands the calling thread's cached arrays back to libc */
+void lalloc_array_release();
+
+lalloc_array_stats_t lalloc_array_stats();
+
+/* Live bytes for the calling thread. Slab objects and arrays count the whole
+ * block they take up, not the pages behind them. */
+typedef struct {
+  size_t live;
+  size_t peak;  /* highest live since the quota was last started */
+  size_t base;  /* live when it was started */
+  size_t quota; /* how far live may climb above base, 0 for no limit */
+  unsigned long exceeded; /* quotas that ran out */
+} lalloc_usage_t;
+
+/* Memory straight from libc that should still be counted */
+void *lalloc_raw(size_t size);
+void lalloc_raw_free(void *ptr, size_t size);
+
+/* Adjusts the count directly, e.g. for memory another thread freed on this
+ * one's behalf */
+void lalloc_account(ptrdiff_t bytes);
+
+/* Allows quota more bytes than are live now. Once they are used up
+ * lalloc_quota_exceeded() says so until the next call, but allocations keep
+ * succeeding: it's up to the caller to stop. */
+void lalloc_quota_begin(size_t quota);
+int lalloc_quota_exceeded();
+
+lalloc_usage_t lalloc_usage();
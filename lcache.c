@@ -0,0 +1,141 @@
+#include <stdlib.h>
+
+#include "lval.h"
+#include "lgc.h"
+#include "lcache.h"
+#include "lfold.h"
+
+#define LCACHE_SIZE 64
+
+/* Folded bodies that mention more symbols than this are only kept until
+ * anything in the environment changes */
+#define LCACHE_MAX_DEPS 16
+
+/* Direct mapped on the list's address */
+static struct {
+  lval_t *list;
+  const lcache_ops_t *ops;
+  void *code;
+
+  /* Symbols the code was folded with and their lenv_stamp() at the time, or
+   * -1 deps and the environment's version if there were too many */
+  int depCount;
+  const char *deps[LCACHE_MAX_DEPS];
+  unsigned long stamps[LCACHE_MAX_DEPS];
+  unsigned long version;
+} cache[LCACHE_SIZE];
+
+static int lcache_cacheable(lval_t *list) {
+  if (lval_is_fixnum(list)) {
+    return 0;
+  }
+
+#ifdef LGC
+  /* Old nodes are never written to, nor do they live in the nursery */
+  return list->flags & LVAL_F_OLD;
+#else
+  /* A shared list is copied before anything writes to it, and the cache's
+   * own reference keeps it shared. Lists nobody else holds are one-offs. */
+  return (list->flags & LVAL_F_OLD) || list->refs >= 2;
+#endif
+}
+
+static void lcache_evict(size_t slot) {
+  if (cache[slot].list != NULL) {
+    cache[slot].ops->del(cache[slot].code);
+    lval_del(cache[slot].list);
+    cache[slot].list = NULL;
+    cache[slot].code = NULL;
+  }
+}
+
+/* Records the symbols list's S-Expressions mention, which are all that
+ * folding it looked up, returning 0 once there are too many */
+static int lcache_deps(size_t slot, lval_t *list, lenv_t *env) {
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    if (lval_type(child) == LVAL_SEXPR && !lcache_deps(slot, child, env)) {
+      return 0;
+    }
+
+    if (lval_type(child) != LVAL_SYM) {
+      continue;
+    }
+
+    int seen = 0;
+    for (int j = 0; j < cache[slot].depCount && !seen; j++) {
+      seen = cache[slot].deps[j] == child->sym;
+    }
+
+    if (seen) {
+      continue;
+    }
+
+    if (cache[slot].depCount == LCACHE_MAX_DEPS) {
+      return 0;
+    }
+
+    cache[slot].deps[cache[slot].depCount] = child->sym;
+    cache[slot].stamps[cache[slot].depCount] = lenv_stamp(env, child->sym);
+    cache[slot].depCount++;
+  }
+
+  return 1;
+}
+
+/* Whether nothing the code was folded with has been bound again since */
+static int lcache_fresh(size_t slot, lenv_t *env) {
+  if (cache[slot].depCount < 0) {
+    return cache[slot].version == env->version;
+  }
+
+  for (int i = 0; i < cache[slot].depCount; i++) {
+    if (lenv_stamp(env, cache[slot].deps[i]) != cache[slot].stamps[i]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void *lcache_get(lval_t *list, lenv_t *env, lbuiltin apply, const lcache_ops_t *ops) {
+  if (!lcache_cacheable(list)) {
+    return NULL;
+  }
+
+  size_t slot = ((uintptr_t) list >> 4) % LCACHE_SIZE;
+
+  if (cache[slot].list != list || cache[slot].ops != ops || !lcache_fresh(slot, env)) {
+    lcache_evict(slot);
+
+    lval_t *body = lval_copy(list);
+    int folded = 0;
+#ifndef LGC
+    /* Results would be young, and the code outlives the nursery */
+    folded = lfold(&body, env, apply);
+#endif
+
+    /* Code nothing was folded into doesn't depend on the environment */
+    cache[slot].depCount = 0;
+    cache[slot].version = env->version;
+
+    if (folded > 0 && !lcache_deps(slot, list, env)) {
+      cache[slot].depCount = -1;
+    }
+
+    cache[slot].list = lval_copy(list);
+    cache[slot].ops = ops;
+    cache[slot].code = ops->compile(body);
+    lval_del(body);
+  }
+
+  ops->retain(cache[slot].code);
+  return cache[slot].code;
+}
+
+void lcache_release() {
+  for (size_t i = 0; i < LCACHE_SIZE; i++) {
+    lcache_evict(i);
+  }
+}
@@ -0,0 +1,34 @@
+/*
+ * Cache of code compiled from eval bodies, shared by the bytecode compiler
+ * (lvm.h), the closure compiler (lclos.h) and the tree walker, whose code
+ * is just the folded body.
+ *
+ * Code is looked up by the list it was compiled from. Bodies are constant
+ * folded with the bindings of the time (see lfold.h), so code that anything
+ * was folded into is also checked against the lenv_stamp() of each symbol
+ * the body mentions, and compiled again once one of them has been bound
+ * anew. Other changes to the environment leave it cached. The cache
+ * keeps a reference to each list, so nothing can change or reuse it while
+ * its code is cached, and callers get a reference to the code that outlives
+ * any eviction.
+ *
+ * Only lists that can't change are cached: under LGC that means old ones,
+ * since young lists and anything folded from them go away with the nursery.
+ *
+ * Include after lval.h.
+ */
+
+/* How one evaluator's code is made and reference counted. compile borrows
+ * the list. */
+typedef struct {
+  void *(*compile)(lval_t *list);
+  void (*retain)(void *code);
+  void (*del)(void *code);
+} lcache_ops_t;
+
+/* Code for list, borrowed, as compiled by ops once folded in env with
+ * apply. Returns NULL for lists that can't be cached. */
+void *lcache_get(lval_t *list, lenv_t *env, lbuiltin apply, const lcache_ops_t *ops);
+
+/* Drop everything cached, which also lets go of the lists */
+void lcache_release();
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdlib.h>
+
+#include "lval.h"
+#include "lcensus.h"
+
+#define LCENSUS_MAX_SITES 2048
+#define LCENSUS_MAX_NAMES 64
+
+/* Site 0 collects whatever didn't fit in the table */
+static lcensus_site_t sites[LCENSUS_MAX_SITES];
+static size_t site_count = 1;
+
+static lcensus_row_t cells = { 0, 0 };
+static lcensus_row_t regions = { 0, 0 };
+
+static struct {
+  lbuiltin fun;
+  const char *name;
+} names[LCENSUS_MAX_NAMES];
+static int name_count = 0;
+
+#ifndef LCENSUS
+
+size_t lcensus_env_bytes(lenv_t *env) {
+  return 0;
+}
+
+#else
+
+#ifdef LRECLAIM
+#error "LCENSUS can't be combined with LRECLAIM"
+#endif
+
+/* Open-addressed index into sites, at most half full */
+#define LCENSUS_INDEX_SIZE (2 * LCENSUS_MAX_SITES)
+
+static uint16_t site_index[LCENSUS_INDEX_SIZE];
+
+static lbuiltin caller = NULL;
+static volatile sig_atomic_t dump_requested = 0;
+
+static void lcensus_on_signal(int sig) {
+  dump_requested = 1;
+}
+
+static void lcensus_init() {
+  struct sigaction action = { 0 };
+  action.sa_handler = lcensus_on_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &action, NULL);
+
+  sites[0].ctor = "other";
+}
+
+static unsigned long lcensus_hash(const char *ctor, lbuiltin fun, lval_type_t type) {
+  unsigned long hash = 14695981039346656037UL;
+  hash = (hash ^ (uintptr_t) ctor) * 1099511628211UL;
+  hash = (hash ^ (uintptr_t) fun) * 1099511628211UL;
+  return (hash ^ type) * 1099511628211UL;
+}
+
+static uint16_t lcensus_site(const char *ctor, lval_type_t type) {
+  /* Nodes tend to come in runs from the same place */
+  static uint16_t last = 0;
+  lcensus_site_t *site = &sites[last];
+
+  if (last != 0 && site->ctor == ctor && site->caller == caller && site->type == type) {
+    return last;
+  }
+
+  size_t slot = lcensus_hash(ctor, caller, type) & (LCENSUS_INDEX_SIZE - 1);
+  while (site_index[slot] != 0) {
+    site = &sites[site_index[slot]];
+
+    if (site->ctor == ctor && site->caller == caller && site->type == type) {
+      return last = site_index[slot];
+    }
+
+    slot = (slot + 1) & (LCENSUS_INDEX_SIZE - 1);
+  }
+
+  if (site_count == LCENSUS_MAX_SITES) {
+    return 0;
+  }
+
+  if (site_count == 1) {
+    lcensus_init();
+  }
+
+  site = &sites[site_count];
+  site->ctor = ctor;
+  site->caller = caller;
+  site->type = type;
+  site_index[slot] = (uint16_t) site_count;
+  return last = (uint16_t) site_count++;
+}
+
+static size_t lcensus_node_bytes(lval_t *val) {
+  return (val->flags & LVAL_F_EMBEDDED) ? LVAL_EMBEDDED_SIZE : sizeof(lval_t);
+}
+
+void lcensus_alloc(lval_t *val, const char *ctor) {
+  val->site = lcensus_site(ctor, val->type);
+
+  lcensus_site_t *site = &sites[val->site];
+  site->live.count++;
+  site->live.bytes += lcensus_node_bytes(val);
+  site->allocs++;
+}
+
+void lcensus_free(lval_t *val) {
+  lcensus_site_t *site = &sites[val->site];
+  site->live.count--;
+  site->live.bytes -= lcensus_node_bytes(val);
+}
+
+void lcensus_cells_alloc(size_t bytes) {
+  cells.count++;
+  cells.bytes += bytes;
+}
+
+void lcensus_cells_free(size_t bytes) {
+  cells.count--;
+  cells.bytes -= bytes;
+}
+
+void lcensus_region_alloc(size_t bytes) {
+  regions.count++;
+  regions.bytes += bytes;
+}
+
+void lcensus_region_free(size_t bytes) {
+  regions.count--;
+  regions.bytes -= bytes;
+}
+
+void lcensus_name(lbuiltin fun, const char *name) {
+  if (name_count < LCENSUS_MAX_NAMES) {
+    names[name_count].fun = fun;
+    names[name_count].name = name;
+    name_count++;
+  }
+}
+
+lbuiltin lcensus_enter(lbuiltin fun) {
+  lbuiltin prev = caller;
+  caller = fun;
+  return prev;
+}
+
+void lcensus_leave(lbuiltin prev) {
+  caller = prev;
+}
+
+void lcensus_poll(lenv_t *env) {
+  if (dump_requested) {
+    dump_requested = 0;
+    lcensus_dump(env, stderr);
+  }
+}
+
+size_t lcensus_env_bytes(lenv_t *env) {
+  return lenv_footprint(env);
+}
+
+#endif
+
+size_t lcensus_sites(const lcensus_site_t **out) {
+  *out = sites;
+  return site_count;
+}
+
+lcensus_row_t lcensus_type(lval_type_t type) {
+  lcensus_row_t row = { 0, 0 };
+
+  for (size_t i = 1; i < site_count; i++) {
+    if (sites[i].type == type) {
+      row.count += sites[i].live.count;
+      row.bytes += sites[i].live.bytes;
+    }
+  }
+
+  return row;
+}
+
+lcensus_row_t lcensus_cells() {
+  return cells;
+}
+
+lcensus_row_t lcensus_regions() {
+  return regions;
+}
+
+const char *lcensus_caller_name(lbuiltin fun) {
+  for (int i = 0; i < name_count; i++) {
+    if (names[i].fun == fun) {
+      return names[i].name;
+    }
+  }
+
+  return fun == NULL ? "top" : "?";
+}
+
+static int lcensus_by_bytes(const void *a, const void *b) {
+  const lcensus_site_t *x = *(const lcensus_site_t **) a;
+  const lcensus_site_t *y = *(const lcensus_site_t **) b;
+  return (x->live.bytes < y->live.bytes) - (x->live.bytes > y->live.bytes);
+}
+
+/* Biggest sites first, leaving out the ones with nothing live */
+void lcensus_dump(lenv_t *env, FILE *out) {
+  fputs("=== heap census ===\n", out);
+
+  for (lval_type_t type = LVAL_ERR; type <= LVAL_QEXPR; type++) {
+    lcensus_row_t row = lcensus_type(type);
+    fprintf(out, "%-14s %10lu nodes %12zu bytes\n",
+        lval_type_desc(type), row.count, row.bytes);
+  }
+
+  fprintf(out, "%-14s %10lu blocks %11zu bytes\n", "cells", cells.count, cells.bytes);
+  fprintf(out, "%-14s %10lu regions %10zu bytes\n", "compact", regions.count, regions.bytes);
+  fprintf(out, "%-14s %29zu bytes\n", "environment", lcensus_env_bytes(env));
+
+  const lcensus_site_t *sorted[LCENSUS_MAX_SITES];
+  size_t count = 0;
+
+  for (size_t i = 0; i < site_count; i++) {
+    if (sites[i].live.count > 0) {
+      sorted[count++] = &sites[i];
+    }
+  }
+
+  qsort(sorted, count, sizeof(sorted[0]), lcensus_by_bytes);
+
+  fprintf(out, "%-10s %-12s %-14s %10s %12s %12s\n",
+      "site", "caller", "type", "live", "bytes", "allocs");
+
+  for (size_t i = 0; i < count; i++) {
+    const lcensus_site_t *site = sorted[i];
+    fprintf(out, "%-10s %-12s %-14s %10lu %12zu %12lu\n",
+        site->ctor, lcensus_caller_name(site->caller), lval_type_desc(site->type),
+        site->live.count, site->live.bytes, site->allocs);
+  }
+}
@@ -0,0 +1,89 @@
+/*
+ * Optional heap census, enabled by compiling with -DLCENSUS.
+ *
+ * Every node is tagged when it is created with an allocation site: the
+ * constructor that made it, the type it was made with and the builtin that
+ * was running at the time. Live counts and bytes are kept per site, and for
+ * list blocks and compacted regions as a whole, so a leak or a bloated
+ * builtin shows up as a site that keeps growing.
+ *
+ * Node bytes are the node itself, or the node and its first block for lists
+ * allocated together with one. Blocks allocated separately and compacted
+ * regions are counted on their own. A node's lifetime runs from its
+ * constructor to its last lval_del(), so nodes copied into a compacted region
+ * count towards the region from then on.
+ *
+ * Sending the process SIGUSR2 dumps the census to stderr the next time a
+ * builtin is called.
+ *
+ * Can't be combined with -DLRECLAIM, whose thread frees nodes without going
+ * through lval_del(). Without -DLCENSUS the hooks below compile to nothing
+ * and the reports are empty.
+ *
+ * Include after lval.h.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct {
+  unsigned long count;
+  size_t bytes;
+} lcensus_row_t;
+
+typedef struct {
+  const char *ctor;
+  lbuiltin caller; /* NULL at the top level */
+  lval_type_t type;
+  lcensus_row_t live;
+  unsigned long allocs; /* over the lifetime of the process */
+} lcensus_site_t;
+
+#ifdef LCENSUS
+
+void lcensus_alloc(lval_t *val, const char *ctor);
+void lcensus_free(lval_t *val);
+void lcensus_cells_alloc(size_t bytes);
+void lcensus_cells_free(size_t bytes);
+void lcensus_region_alloc(size_t bytes);
+void lcensus_region_free(size_t bytes);
+
+/* Record what a builtin is called, and which one is running */
+void lcensus_name(lbuiltin fun, const char *name);
+lbuiltin lcensus_enter(lbuiltin fun);
+void lcensus_leave(lbuiltin prev);
+
+/* Dumps the census if SIGUSR2 arrived since the last call */
+void lcensus_poll(lenv_t *env);
+
+#else
+
+static inline void lcensus_alloc(lval_t *val, const char *ctor) {}
+static inline void lcensus_free(lval_t *val) {}
+static inline void lcensus_cells_alloc(size_t bytes) {}
+static inline void lcensus_cells_free(size_t bytes) {}
+static inline void lcensus_region_alloc(size_t bytes) {}
+static inline void lcensus_region_free(size_t bytes) {}
+
+static inline void lcensus_name(lbuiltin fun, const char *name) {}
+static inline lbuiltin lcensus_enter(lbuiltin fun) { return NULL; }
+static inline void lcensus_leave(lbuiltin prev) {}
+
+static inline void lcensus_poll(lenv_t *env) {}
+
+#endif
+
+/* Sites in the order they were first seen */
+size_t lcensus_sites(const lcensus_site_t **sites);
+lcensus_row_t lcensus_type(lval_type_t type);
+lcensus_row_t lcensus_cells();
+lcensus_row_t lcensus_regions();
+
+/* Name of a builtin, or "top" for NULL */
+const char *lcensus_caller_name(lbuiltin fun);
+
+/* Bytes held by the environment: its table plus everything its values keep
+ * alive, see lenv_footprint() */
+size_t lcensus_env_bytes(lenv_t *env);
+
+void lcensus_dump(lenv_t *env, FILE *out);
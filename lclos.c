@@ -0,0 +1,382 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lalloc.h"
+#include "lcensus.h"
+#include "lclos.h"
+#include "lcache.h"
+
+typedef struct lclos_node lclos_node_t;
+
+/* What every node is run with */
+typedef struct {
+  lenv_t *env;
+  lbuiltin apply;
+  lbuiltin eval;
+} lclos_ctx_t;
+
+typedef lval_t *(*lclos_fn)(lclos_node_t *node, lclos_ctx_t *ctx);
+
+/* Leaves carry the function that evaluates them. Calls have none: lclos_run
+ * evaluates them itself, with a stack of frames rather than by recursion. */
+struct lclos_node {
+  lclos_fn run;
+  lval_t *val; /* the constant, or the symbol */
+
+  /* Symbols: the value borrowed from env when it was at version */
+  lval_t *bound;
+  lenv_t *env;
+  unsigned long version;
+
+  /* S-Expressions. Direct calls have a symbol in front and arguments after
+   * it, and call its builtin with exactly count - 1 arguments rather than
+   * through apply. */
+  int count;
+  int direct;
+  lclos_node_t **kids;
+};
+
+/* A call whose children are being evaluated, next one first */
+typedef struct {
+  lclos_node_t *node;
+  lval_t *fun;          /* what kids[0] of a direct call evaluated to */
+  lval_t *args;         /* what the children before next evaluated to */
+  int next;
+  lclos_code_t *owned;  /* code node belongs to, if an eval compiled it */
+} lclos_frame_t;
+
+/* Deeper nesting than this takes its frames from the heap */
+#define LCLOS_STACK_SIZE 32
+
+/* Nodes and their children's pointers live in the same allocation as the
+ * header, the root first */
+struct lclos_code {
+  uint32_t refs;
+  size_t size;
+  int nodeCount;
+  int kidCount;
+  lclos_node_t *nodes;
+  lclos_node_t **kids;
+};
+
+static lval_t *lclos_num(lclos_node_t *node, lclos_ctx_t *ctx) {
+  return node->val;
+}
+
+static lval_t *lclos_const(lclos_node_t *node, lclos_ctx_t *ctx) {
+  return lval_copy(node->val);
+}
+
+static lval_t *lclos_global(lclos_node_t *node, lclos_ctx_t *ctx) {
+  if (node->env != ctx->env || node->version != ctx->env->version) {
+    node->bound = lenv_touch(ctx->env, node->val->sym);
+    node->env = ctx->env;
+    node->version = ctx->env->version;
+  }
+
+  if (node->bound == NULL) {
+    return lval_err("unbound symbol");
+  }
+
+  return lval_copy(node->bound);
+}
+
+/* Code for eval's argument, if calling fun with argc arguments is an eval */
+static lclos_code_t *lclos_eval_code(lval_t *fun, int argc, lval_t **argv,
+    lclos_ctx_t *ctx) {
+  if (argc != 1 || lval_type(fun) != LVAL_FUN || fun->builtin != ctx->eval
+      || lval_type(argv[0]) != LVAL_QEXPR) {
+    return NULL;
+  }
+
+  lclos_code_t *code = lclos_compile_cached(argv[0], ctx->env, ctx->apply);
+  return code != NULL ? code : lclos_compile(argv[0]);
+}
+
+/* A direct call's builtin, as lval_apply() would call it once it had popped
+ * fun off the front of the arguments */
+static lval_t *lclos_call(lclos_ctx_t *ctx, lval_t *fun, lval_t *args) {
+  if (lval_type(fun) != LVAL_FUN) {
+    lval_del(fun);
+    lval_del(args);
+    return lval_err("first element is not a function");
+  }
+
+  lcensus_poll(ctx->env);
+
+  lbuiltin caller = lcensus_enter(fun->builtin);
+  lval_t *result = fun->builtin(ctx->env, args);
+  lcensus_leave(caller);
+  lval_del(fun);
+
+  if (lalloc_quota_exceeded() && lval_type(result) != LVAL_ERR) {
+    lval_del(result);
+    return lval_err("Memory quota exceeded!");
+  }
+
+  return result;
+}
+
+/* fun is what a direct call's kids[0] evaluated to, NULL for other calls */
+static lclos_frame_t *lclos_push(lclos_frame_t *frames, lclos_frame_t *small,
+    int *capacity, int *depth, lclos_node_t *node, lval_t *fun, lclos_code_t *owned) {
+  if (*depth == *capacity) {
+    lclos_frame_t *grown = lalloc_raw(sizeof(lclos_frame_t) * *capacity * 2);
+    memcpy(grown, frames, sizeof(lclos_frame_t) * *capacity);
+
+    if (frames != small) {
+      lalloc_raw_free(frames, sizeof(lclos_frame_t) * *capacity);
+    }
+
+    frames = grown;
+    *capacity *= 2;
+  }
+
+  lval_t *args = lval_sexpr();
+  lval_reserve(args, fun != NULL ? node->count - 1 : node->count);
+
+  frames[*depth].node = node;
+  frames[*depth].fun = fun;
+  frames[*depth].args = args;
+  frames[*depth].next = fun != NULL ? 1 : 0;
+  frames[*depth].owned = owned;
+  (*depth)++;
+  return frames;
+}
+
+/* Counts what a list compiles to, to size the code up front */
+static void lclos_measure(lval_t *list, int *nodes, int *kids) {
+  (*nodes)++;
+  *kids += list->count;
+
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    if (lval_type(child) == LVAL_SEXPR) {
+      lclos_measure(child, nodes, kids);
+    } else {
+      (*nodes)++;
+    }
+  }
+}
+
+static lclos_node_t *lclos_node(lclos_code_t *code, lclos_fn run, lval_t *val) {
+  lclos_node_t *node = &code->nodes[code->nodeCount++];
+  node->run = run;
+  node->val = val;
+  node->bound = NULL;
+  node->env = NULL;
+  node->version = 0;
+  node->count = 0;
+  node->kids = NULL;
+  node->direct = 0;
+  return node;
+}
+
+static lclos_node_t *lclos_emit(lclos_code_t *code, lval_t *list) {
+  lclos_node_t *node = lclos_node(code, NULL, NULL);
+  node->count = list->count;
+  node->kids = &code->kids[code->kidCount];
+  node->direct = list->count >= 2 && lval_type(list->cell[0]) == LVAL_SYM;
+  code->kidCount += list->count;
+
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    if (lval_type(child) == LVAL_SEXPR) {
+      node->kids[i] = lclos_emit(code, child);
+    } else if (lval_type(child) == LVAL_SYM) {
+      node->kids[i] = lclos_node(code, lclos_global, lval_copy(child));
+    } else if (lval_is_fixnum(child)) {
+      node->kids[i] = lclos_node(code, lclos_num, child);
+    } else {
+      node->kids[i] = lclos_node(code, lclos_const, lval_copy(child));
+    }
+  }
+
+  return node;
+}
+
+lclos_code_t *lclos_compile(lval_t *list) {
+  int nodes = 0;
+  int kids = 0;
+  lclos_measure(list, &nodes, &kids);
+
+  size_t size = sizeof(lclos_code_t) + sizeof(lclos_node_t) * nodes
+    + sizeof(lclos_node_t *) * kids;
+  lclos_code_t *code = lalloc_raw(size);
+
+  code->refs = 1;
+  code->size = size;
+  code->nodeCount = 0;
+  code->kidCount = 0;
+  code->nodes = (lclos_node_t *) (code + 1);
+  code->kids = (lclos_node_t **) (code->nodes + nodes);
+
+  lclos_emit(code, list);
+  return code;
+}
+
+void lclos_code_del(lclos_code_t *code) {
+  if (--code->refs > 0) {
+    return;
+  }
+
+  for (int i = 0; i < code->nodeCount; i++) {
+    if (code->nodes[i].val != NULL) {
+      lval_del(code->nodes[i].val);
+    }
+  }
+
+  lalloc_raw_free(code, code->size);
+}
+
+/* A call to eval runs its argument's code in place of the call, handing the
+ * result to the frame the call would have, so chains of evals run in
+ * constant space and nesting is only limited by memory */
+lval_t *lclos_run(lclos_code_t *code, lenv_t *env, lbuiltin apply, lbuiltin eval) {
+  lclos_ctx_t ctx = { env, apply, eval };
+
+  lclos_frame_t small[LCLOS_STACK_SIZE];
+  lclos_frame_t *frames = small;
+  int capacity = LCLOS_STACK_SIZE;
+  int depth = 0;
+  int evaled = 0;
+
+  /* The call to enter next, and the code it belongs to if ours to delete */
+  lclos_node_t *call = code->nodes;
+  lclos_code_t *callOwned = NULL;
+  lval_t *val;
+
+  while (1) {
+    if (call != NULL) {
+      /* A direct call's function is evaluated first, as the front of any
+       * other list would be, and nothing else is once it fails */
+      lval_t *fun = NULL;
+
+      if (call->direct) {
+        lclos_node_t *head = call->kids[0];
+        fun = head->run(head, &ctx);
+      }
+
+      if (fun == NULL || lval_type(fun) != LVAL_ERR) {
+        frames = lclos_push(frames, small, &capacity, &depth, call, fun, callOwned);
+        call = NULL;
+        callOwned = NULL;
+        continue;
+      }
+
+      if (callOwned != NULL) {
+        lclos_code_del(callOwned);
+      }
+
+      val = fun;
+    } else {
+      lclos_frame_t *frame = &frames[depth - 1];
+
+      if (frame->next < frame->node->count) {
+        lclos_node_t *kid = frame->node->kids[frame->next];
+
+        if (kid->run == NULL) {
+          call = kid;
+          continue;
+        }
+
+        val = kid->run(kid, &ctx);
+      } else {
+        lval_t *fun = frame->fun;
+        lval_t *args = frame->args;
+        lclos_code_t *owned = frame->owned;
+        depth--;
+
+        lclos_code_t *next = NULL;
+        if (fun != NULL) {
+          next = lclos_eval_code(fun, args->count, args->cell, &ctx);
+        } else if (args->count > 0) {
+          next = lclos_eval_code(args->cell[0], args->count - 1, args->cell + 1, &ctx);
+        }
+
+        if (next != NULL) {
+          if (fun != NULL) {
+            lval_del(fun);
+          }
+
+          lval_del(args);
+          if (owned != NULL) {
+            lclos_code_del(owned);
+          }
+
+          call = next->nodes;
+          callOwned = next;
+          evaled = 1;
+          continue;
+        }
+
+        val = fun != NULL ? lclos_call(&ctx, fun, args) : apply(env, args);
+        if (owned != NULL) {
+          lclos_code_del(owned);
+        }
+
+        if (depth == 0) {
+          break;
+        }
+      }
+    }
+
+    /* Every call hands an error straight up, through all the frames */
+    if (lval_type(val) == LVAL_ERR) {
+      break;
+    }
+
+    lclos_frame_t *frame = &frames[depth - 1];
+    lval_add(frame->args, val);
+    frame->next++;
+  }
+
+  /* Frames left by an error still own their arguments and code */
+  while (depth > 0) {
+    depth--;
+    lval_del(frames[depth].args);
+
+    if (frames[depth].fun != NULL) {
+      lval_del(frames[depth].fun);
+    }
+
+    if (frames[depth].owned != NULL) {
+      lclos_code_del(frames[depth].owned);
+    }
+  }
+
+  if (frames != small) {
+    lalloc_raw_free(frames, sizeof(lclos_frame_t) * capacity);
+  }
+
+  /* The evals that were run in place never went through apply */
+  if (evaled && lalloc_quota_exceeded() && lval_type(val) != LVAL_ERR) {
+    lval_del(val);
+    val = lval_err("Memory quota exceeded!");
+  }
+
+  return val;
+}
+
+static void *lclos_cache_compile(lval_t *list) {
+  return lclos_compile(list);
+}
+
+static void lclos_cache_retain(void *code) {
+  ((lclos_code_t *) code)->refs++;
+}
+
+static void lclos_cache_del(void *code) {
+  lclos_code_del(code);
+}
+
+static const lcache_ops_t lclos_cache_ops = {
+  lclos_cache_compile, lclos_cache_retain, lclos_cache_del
+};
+
+lclos_code_t *lclos_compile_cached(lval_t *list, lenv_t *env, lbuiltin apply) {
+  return lcache_get(list, env, apply, &lclos_cache_ops);
+}
@@ -0,0 +1,32 @@
+/*
+ * Closure compiler, used instead of the tree walker when byol is started
+ * with --closures.
+ *
+ * A list compiles to a tree of nodes, each carrying the C function that
+ * evaluates it and its children already compiled. Numbers that fit in a
+ * fixnum, other constants, symbols and S-Expressions each get a node type of
+ * their own, and so do calls with a symbol in front, which hand their
+ * arguments straight to the builtin it names. Symbols remember what they
+ * were bound to and look again only once the environment has changed, see
+ * lenv_t's version. S-Expressions are run by lclos_run() on a stack of its
+ * own, so nesting, evals included, is only limited by memory.
+ *
+ * Evaluation order, builtins and errors are exactly those of lval_eval(),
+ * including chains of evals running in constant space.
+ *
+ * Include after lval.h.
+ */
+
+typedef struct lclos_code lclos_code_t;
+
+/* Compiles the evaluation of list, borrowed, as an S-Expression, whatever
+ * its type. Code is reference counted like values are. */
+lclos_code_t *lclos_compile(lval_t *list);
+void lclos_code_del(lclos_code_t *code);
+
+/* apply and eval are those of lvm_run() */
+lval_t *lclos_run(lclos_code_t *code, lenv_t *env, lbuiltin apply, lbuiltin eval);
+
+/* lclos_compile() for immutable lists, folded and cached, see lcache.h.
+ * Returns NULL for lists that can't be cached. */
+lclos_code_t *lclos_compile_cached(lval_t *list, lenv_t *env, lbuiltin apply);
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+
+#include "lval.h"
+#include "lfold.h"
+
+#define LFOLD_MAX_PURE 16
+
+static lbuiltin pure[LFOLD_MAX_PURE];
+static int pure_count = 0;
+
+static lfold_stats_t stats = { 0, 0, 0 };
+
+void lfold_pure(lbuiltin fun) {
+  if (pure_count < LFOLD_MAX_PURE) {
+    pure[pure_count++] = fun;
+  }
+}
+
+static int lfold_is_pure(lbuiltin fun) {
+  for (int i = 0; i < pure_count; i++) {
+    if (pure[i] == fun) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Whether evaluating list can only ever call pure builtins */
+static int lfold_safe(lval_t *list, lenv_t *env) {
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    if (lval_type(child) == LVAL_SEXPR && !lfold_safe(child, env)) {
+      return 0;
+    }
+
+    if (lval_type(child) == LVAL_SYM) {
+      lval_t *bound = lenv_borrow(env, child->sym);
+
+      if (bound != NULL && lval_type(bound) == LVAL_FUN && !lfold_is_pure(bound->builtin)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/* The value of a call whose arguments are all constants, or NULL */
+static lval_t *lfold_call(lval_t *call, lenv_t *env, lbuiltin apply) {
+  if (call->count < 2 || lval_type(call->cell[0]) != LVAL_SYM) {
+    return NULL;
+  }
+
+  lval_t *fun = lenv_borrow(env, call->cell[0]->sym);
+  if (fun == NULL || lval_type(fun) != LVAL_FUN || !lfold_is_pure(fun->builtin)) {
+    return NULL;
+  }
+
+  for (int i = 1; i < call->count; i++) {
+    lval_type_t type = lval_type(call->cell[i]);
+
+    if (type != LVAL_NUM && type != LVAL_QEXPR) {
+      return NULL;
+    }
+  }
+
+  lval_t *args = lval_sexpr();
+  lval_add(args, lval_copy(fun));
+
+  for (int i = 1; i < call->count; i++) {
+    lval_add(args, lval_copy(call->cell[i]));
+  }
+
+  /* Errors are left for the evaluation itself to raise */
+  lval_t *result = apply(env, args);
+  if (lval_type(result) == LVAL_ERR) {
+    lval_del(result);
+    return NULL;
+  }
+
+  return result;
+}
+
+/* Folds list's children, copying it first if one of them changes */
+static lval_t *lfold_children(lval_t *list, lenv_t *env, lbuiltin apply, int *count) {
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+    if (lval_type(child) != LVAL_SEXPR) {
+      continue;
+    }
+
+    lval_t *folded = lfold_children(lval_copy(child), env, apply, count);
+    lval_t *result = lfold_call(folded, env, apply);
+
+    if (result != NULL) {
+      lval_del(folded);
+      folded = result;
+      (*count)++;
+    }
+
+    if (folded == child) {
+      lval_del(folded);
+      continue;
+    }
+
+    list = lval_unshare(list);
+    lval_del(list->cell[i]);
+    list->cell[i] = folded;
+  }
+
+  return list;
+}
+
+int lfold(lval_t **list, lenv_t *env, lbuiltin apply) {
+  if (!lfold_safe(*list, env)) {
+    stats.skipped++;
+    return 0;
+  }
+
+  int count = 0;
+  *list = lfold_children(*list, env, apply, &count);
+
+  stats.passes++;
+  stats.folded += count;
+  return count;
+}
+
+lfold_stats_t lfold_stats() {
+  return stats;
+}
@@ -0,0 +1,31 @@
+/*
+ * Constant folding, run over each program before it is evaluated and over
+ * eval bodies as each evaluator caches them, see lcache.h.
+ *
+ * Calls to pure builtins whose arguments are all numbers or Q-Expressions,
+ * once their own calls have been folded, are replaced by their result.
+ * Q-Expressions are data and are left exactly as written, and calls that
+ * fail are kept so the error still happens where and when it would have.
+ *
+ * Folding uses the builtins bound when it runs. A program that mentions any
+ * function that isn't pure, such as def or eval, could change those bindings
+ * halfway through, so it isn't folded at all.
+ *
+ * Include after lval.h.
+ */
+
+typedef struct {
+  unsigned long passes;
+  unsigned long skipped; /* programs left alone for mentioning impure functions */
+  unsigned long folded;  /* calls replaced by their result */
+} lfold_stats_t;
+
+/* Marks a builtin as free of side effects, so calls to it can be folded */
+void lfold_pure(lbuiltin fun);
+
+/* Folds the calls inside list, moved, as if it were about to be evaluated
+ * as an S-Expression in env. apply is used as lval_eval() would. Returns how
+ * many calls were folded. */
+int lfold(lval_t **list, lenv_t *env, lbuiltin apply);
+
+lfold_stats_t lfold_stats();
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lval.h"
+#include "lalloc.h"
+#include "lgc.h"
+
+/* Collect once the nursery has handed out this many bytes. As a region the
+ * nursery is reset after every evaluation. */
+#ifndef LGC_NURSERY_LIMIT
+#ifdef LGC_REGION
+#define LGC_NURSERY_LIMIT 0
+#else
+#define LGC_NURSERY_LIMIT (4 * 1024 * 1024)
+#endif
+#endif
+
+#define LGC_CHUNK_SIZE (256 * 1024)
+
+static lgc_stats_t stats = { 0, 0, 0, 0, 0 };
+
+#ifndef LGC
+
+void *lgc_alloc(size_t size) {
+  return lalloc(size);
+}
+
+int lgc_collect(lenv_t *env) {
+  return 0;
+}
+
+void lgc_release() {
+}
+
+#else
+
+/* The nursery is a list of chunks that are bump-allocated in order. They are
+ * kept across resets, so a steady-state nursery never calls into libc. */
+typedef union lgc_chunk {
+  union lgc_chunk *next;
+  char pad[16];
+} lgc_chunk_t;
+
+static lgc_chunk_t *chunks = NULL;
+static lgc_chunk_t *current = NULL;
+static char *bump_ptr = NULL;
+static char *bump_end = NULL;
+
+static void lgc_next_chunk() {
+  lgc_chunk_t *next = current ? current->next : chunks;
+
+  if (next == NULL) {
+    next = lalloc_raw(LGC_CHUNK_SIZE);
+    next->next = NULL;
+
+    if (current) {
+      current->next = next;
+    } else {
+      chunks = next;
+    }
+  }
+
+  current = next;
+  bump_ptr = (char *) (current + 1);
+  bump_end = (char *) current + LGC_CHUNK_SIZE;
+}
+
+void *lgc_alloc(size_t size) {
+  size = (size + 15) & ~((size_t) 15);
+
+  if (bump_ptr == NULL || bump_ptr + size > bump_end) {
+    lgc_next_chunk();
+  }
+
+  void *ptr = bump_ptr;
+  bump_ptr += size;
+  stats.nurseryUsed += size;
+  return ptr;
+}
+
+static lval_t *lgc_promote(lval_t *val);
+
+/* Promote a list block. Young blocks are copied out of the nursery whole,
+ * keeping their layout so every list looking into them keeps its offset. A
+ * block that's already old only holds old nodes, since nobody writes to it. */
+static lval_cells_t *lgc_promote_cells(lval_cells_t *cells) {
+  if (cells->forward != NULL) {
+    return cells->forward;
+  }
+
+  if (cells->old) {
+    return cells;
+  }
+
+  if (cells->young) {
+    size_t size = sizeof(lval_cells_t) + sizeof(lval_t *) * cells->capacity;
+    lval_cells_t *old = lalloc_array(size);
+    memcpy(old, cells, size);
+    old->young = 0;
+
+    cells->forward = old;
+    cells = old;
+  }
+
+  cells->old = 1;
+
+  /* Everything the block owns, not just one list's window */
+  for (int i = cells->lo; i < cells->hi; i++) {
+    cells->slots[i] = lgc_promote(cells->slots[i]);
+  }
+
+  return cells;
+}
+
+/* Copy a young node (and everything young below it) into the slab heap.
+ * Every remaining reference to a young node comes from something that is
+ * itself being promoted, so the reference count carries over unchanged. */
+static lval_t *lgc_promote(lval_t *val) {
+  if (lval_is_fixnum(val) || (val->flags & LVAL_F_OLD)) {
+    return val;
+  }
+
+  if (val->flags & LVAL_F_FORWARDED) {
+    return val->forward;
+  }
+
+  lval_t *old = lalloc(sizeof(lval_t));
+  *old = *val;
+  old->flags |= LVAL_F_OLD;
+
+  val->flags |= LVAL_F_FORWARDED;
+  val->forward = old;
+  stats.promoted++;
+
+  if ((old->type == LVAL_SEXPR || old->type == LVAL_QEXPR) && old->cell != NULL) {
+    lval_cells_t *cells = lgc_promote_cells(lval_cells(old));
+    old->cell = cells->slots + old->offset;
+  }
+
+  return old;
+}
+
+int lgc_collect(lenv_t *env) {
+  if (stats.nurseryUsed < LGC_NURSERY_LIMIT) {
+    return 0;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < env->capacity; i++) {
+    if (env->entries[i].sym != NULL) {
+      env->entries[i].val = lgc_promote(env->entries[i].val);
+    }
+  }
+
+  env->version++;
+
+  /* Everything left in the nursery is now dead or forwarded */
+  current = NULL;
+  bump_ptr = NULL;
+  bump_end = NULL;
+  stats.nurseryUsed = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  unsigned long pause = (end.tv_sec - start.tv_sec) * 1000000000UL
+    + end.tv_nsec - start.tv_nsec;
+
+  stats.collections++;
+  stats.pauseTotalNs += pause;
+  if (pause > stats.pauseMaxNs) {
+    stats.pauseMaxNs = pause;
+  }
+
+  return 1;
+}
+
+/* Free the nursery itself. Only safe once no young nodes are reachable. */
+void lgc_release() {
+  while (chunks != NULL) {
+    lgc_chunk_t *next = chunks->next;
+    lalloc_raw_free(chunks, LGC_CHUNK_SIZE);
+    chunks = next;
+  }
+
+  current = NULL;
+  bump_ptr = NULL;
+  bump_end = NULL;
+  stats.nurseryUsed = 0;
+}
+
+#endif
+
+lgc_stats_t lgc_stats() {
+  return stats;
+}
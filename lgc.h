@@ -0,0 +1,40 @@
+/*
+ * Optional generational collector, enabled by compiling with -DLGC.
+ *
+ * New nodes are bump-allocated from a nursery instead of the slab allocator.
+ * Reference counting still decides when a node dies, but dead young nodes
+ * are never freed individually: their memory is reclaimed wholesale when the
+ * nursery is reset.
+ *
+ * A minor collection may only run at a safe point where the environment is
+ * the complete root set (between top-level evaluations in the REPL). It
+ * promotes every young node reachable from the environment into the slab
+ * heap and resets the nursery. Promoted (old) nodes are immutable, so old
+ * nodes can never point at young ones and no write barrier is needed.
+ *
+ * Compiling with -DLGC_REGION (which implies -DLGC, see lval.h) turns the
+ * nursery into a region scoped to a single top-level evaluation: everything
+ * the evaluation allocates, list blocks included, comes from it, values that
+ * escaped into the environment are evacuated afterwards, and the rest is
+ * dropped in one reset.
+ *
+ * Without -DLGC every function here is a no-op.
+ *
+ * Include after lval.h.
+ */
+
+#include <stddef.h>
+
+typedef struct {
+  unsigned long collections;
+  unsigned long promoted;
+  unsigned long pauseTotalNs;
+  unsigned long pauseMaxNs;
+  size_t nurseryUsed;
+} lgc_stats_t;
+
+void *lgc_alloc(size_t size);
+int lgc_collect(lenv_t *env);
+void lgc_release();
+
+lgc_stats_t lgc_stats();
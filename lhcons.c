@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lalloc.h"
+#include "lsym.h"
+#include "lhcons.h"
+#include "lcensus.h"
+
+static lhcons_stats_t stats = { 0, 0, 0, 0 };
+
+#ifndef LHCONS
+
+lval_t *lhcons(lval_t *val) {
+  return val;
+}
+
+void lhcons_forget(lval_t *val) {
+}
+
+#else
+
+#define LHCONS_INITIAL_CAPACITY 256
+
+typedef struct {
+  unsigned long hash;
+  lval_t *val; /* NULL for an empty slot */
+} lhcons_entry_t;
+
+/* Open-addressed with linear probing, at most half full, and deletion by
+ * backward shift like lenv */
+static lhcons_entry_t *table = NULL;
+static size_t capacity = 0;
+
+static unsigned long lhcons_mix(unsigned long hash, unsigned long word) {
+  return (hash ^ word) * 1099511628211UL;
+}
+
+/* Lists hash their children's pointers, which is only meaningful because
+ * they are canonical already */
+static unsigned long lhcons_hash(lval_t *val) {
+  unsigned long hash = lhcons_mix(14695981039346656037UL, val->type);
+
+  switch (val->type) {
+    case LVAL_NUM: return lhcons_mix(hash, (unsigned long) val->num);
+    case LVAL_SYM: return lhcons_mix(hash, lsym_hash(val->sym));
+
+    case LVAL_FUN:
+      hash = lhcons_mix(hash, (unsigned long) (uintptr_t) val->builtin);
+      return lhcons_mix(hash, val->nullary);
+
+    case LVAL_ERR:
+      for (const char *c = val->err; *c; c++) {
+        hash = lhcons_mix(hash, (unsigned char) *c);
+      }
+
+      hash = lhcons_mix(hash, val->errCode);
+      hash = lhcons_mix(hash, val->errArg);
+      return lhcons_mix(hash, (val->errExpected << 8) | val->errGot);
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      hash = lhcons_mix(hash, val->count);
+
+      for (int i = 0; i < val->count; i++) {
+        hash = lhcons_mix(hash, (unsigned long) (uintptr_t) val->cell[i]);
+      }
+
+      return hash;
+  }
+
+  return hash;
+}
+
+static int lhcons_equal(lval_t *a, lval_t *b) {
+  if (a->type != b->type) {
+    return 0;
+  }
+
+  switch (a->type) {
+    case LVAL_NUM: return a->num == b->num;
+    case LVAL_SYM: return a->sym == b->sym;
+    case LVAL_FUN: return a->builtin == b->builtin && a->nullary == b->nullary;
+    case LVAL_ERR:
+      return a->errCode == b->errCode && a->errArg == b->errArg &&
+        a->errExpected == b->errExpected && a->errGot == b->errGot &&
+        strcmp(a->err, b->err) == 0;
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (a->count != b->count) {
+        return 0;
+      }
+
+      for (int i = 0; i < a->count; i++) {
+        if (a->cell[i] != b->cell[i]) {
+          return 0;
+        }
+      }
+
+      return 1;
+  }
+
+  return 0;
+}
+
+static size_t lhcons_size(lval_t *val) {
+  size_t size = sizeof(lval_t);
+
+  if ((val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && val->count > 0) {
+    size += sizeof(lval_cells_t) + sizeof(lval_t *) * val->count;
+  }
+
+  return size;
+}
+
+static void lhcons_grow() {
+  size_t newCapacity = capacity ? capacity * 2 : LHCONS_INITIAL_CAPACITY;
+  lhcons_entry_t *newTable = lalloc_raw(sizeof(lhcons_entry_t) * newCapacity);
+  memset(newTable, 0, sizeof(lhcons_entry_t) * newCapacity);
+
+  for (size_t i = 0; i < capacity; i++) {
+    if (table[i].val == NULL) {
+      continue;
+    }
+
+    size_t slot = table[i].hash & (newCapacity - 1);
+    while (newTable[slot].val != NULL) {
+      slot = (slot + 1) & (newCapacity - 1);
+    }
+
+    newTable[slot] = table[i];
+  }
+
+  lalloc_raw_free(table, sizeof(lhcons_entry_t) * capacity);
+  table = newTable;
+  capacity = newCapacity;
+}
+
+/* Returns the slot holding a node equal to probe, or the empty slot where
+ * one would go */
+static lhcons_entry_t *lhcons_find(lval_t *probe, unsigned long hash) {
+  size_t slot = hash & (capacity - 1);
+
+  while (table[slot].val != NULL) {
+    if (table[slot].hash == hash && lhcons_equal(table[slot].val, probe)) {
+      break;
+    }
+
+    slot = (slot + 1) & (capacity - 1);
+  }
+
+  return &table[slot];
+}
+
+lval_t *lhcons(lval_t *val) {
+  if (lval_is_fixnum(val) || (val->flags & LVAL_F_HCONS)) {
+    return val;
+  }
+
+  /* Lists are looked up by their canonical children, collected into what
+   * becomes the new node's block if nothing matches */
+  lval_t probe = *val;
+  lval_cells_t *cells = NULL;
+
+  if ((val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && val->count > 0) {
+    cells = lalloc_array(sizeof(lval_cells_t) + sizeof(lval_t *) * val->count);
+
+    for (int i = 0; i < val->count; i++) {
+      cells->slots[i] = lhcons(lval_copy(val->cell[i]));
+    }
+
+    probe.offset = 0;
+    probe.cell = cells->slots;
+  }
+
+  if ((stats.nodes + 1) * 2 > capacity) {
+    lhcons_grow();
+  }
+
+  unsigned long hash = lhcons_hash(&probe);
+  lhcons_entry_t *entry = lhcons_find(&probe, hash);
+  stats.lookups++;
+
+  if (entry->val != NULL) {
+    stats.hits++;
+    stats.bytesSaved += lhcons_size(&probe);
+
+    if (cells != NULL) {
+      for (int i = 0; i < val->count; i++) {
+        lval_del(cells->slots[i]);
+      }
+
+      lalloc_array_free(cells, sizeof(lval_cells_t) + sizeof(lval_t *) * val->count);
+    }
+
+    lval_del(val);
+    return lval_copy(entry->val);
+  }
+
+  /* Canonical nodes come straight from the slab heap, never the nursery,
+   * since the table has to keep pointing at them */
+  lval_t *canon = lalloc(sizeof(lval_t));
+  *canon = probe;
+  canon->flags = LVAL_F_OLD | LVAL_F_HCONS;
+  lval_refs_set(&canon->refs, 1);
+  lcensus_alloc(canon, "hcons");
+
+  if (cells != NULL) {
+    cells->capacity = val->count;
+    cells->lo = 0;
+    cells->hi = val->count;
+    lval_refs_set(&cells->refs, 1);
+    cells->embedded = 0;
+    cells->compact = 0;
+    cells->young = 0;
+    cells->old = 1;
+    cells->forward = NULL;
+    lcensus_cells_alloc(sizeof(lval_cells_t) + sizeof(lval_t *) * val->count);
+  } else if (canon->type == LVAL_SEXPR || canon->type == LVAL_QEXPR) {
+    canon->offset = 0;
+    canon->cell = NULL;
+  }
+
+  entry->hash = hash;
+  entry->val = canon;
+  stats.nodes++;
+
+  lval_del(val);
+  return canon;
+}
+
+/* Called by lval_del() for a canonical node's last reference, while its
+ * children are still alive to be hashed */
+void lhcons_forget(lval_t *val) {
+  size_t mask = capacity - 1;
+  size_t hole = lhcons_hash(val) & mask;
+
+  while (table[hole].val != val) {
+    hole = (hole + 1) & mask;
+  }
+
+  table[hole].val = NULL;
+  stats.nodes--;
+
+  size_t slot = hole;
+  while (1) {
+    slot = (slot + 1) & mask;
+    if (table[slot].val == NULL) {
+      break;
+    }
+
+    size_t home = table[slot].hash & mask;
+
+    /* Leave the entry alone if its home lies cyclically in (hole, slot] */
+    if (((slot - home) & mask) < ((slot - hole) & mask)) {
+      continue;
+    }
+
+    table[hole] = table[slot];
+    table[slot].val = NULL;
+    hole = slot;
+  }
+}
+
+#endif
+
+lhcons_stats_t lhcons_stats() {
+  return stats;
+}
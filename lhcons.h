@@ -0,0 +1,34 @@
+/*
+ * Optional hash-consing of immutable values, enabled by compiling with
+ * -DLHCONS.
+ *
+ * lhcons() maps a value to the single canonical node holding that exact
+ * structure, creating it if needed. Lists are canonicalized bottom up, so
+ * every child of a canonical list is canonical too, and two canonical values
+ * are structurally equal if and only if they are the same pointer. Values
+ * stored in the environment go through here, which folds repeated sub-lists
+ * of large definitions into one shared copy.
+ *
+ * Canonical nodes are flagged LVAL_F_HCONS and immutable. The table only
+ * holds weak references: a canonical node leaves it when its last reference
+ * is dropped.
+ *
+ * Without -DLHCONS lhcons() hands its argument straight back.
+ *
+ * Include after lval.h.
+ */
+
+#include <stddef.h>
+
+typedef struct {
+  unsigned long lookups;
+  unsigned long hits;
+  size_t nodes;      /* canonical nodes currently alive */
+  size_t bytesSaved; /* by hits, over the lifetime of the process */
+} lhcons_stats_t;
+
+/* Takes ownership of val and returns a reference to its canonical node */
+lval_t *lhcons(lval_t *val);
+void lhcons_forget(lval_t *val);
+
+lhcons_stats_t lhcons_stats();
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lalloc.h"
+#include "lgc.h"
+#include "lreclaim.h"
+
+#ifndef LRECLAIM
+
+int lreclaim_offer(lval_cells_t *cells) {
+  return 0;
+}
+
+void lreclaim_drain() {
+}
+
+void lreclaim_release() {
+}
+
+#else
+
+#ifdef LGC
+#error "LRECLAIM can't be combined with LGC"
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+/* Slab memory freed by the reclaimer, chained through its first word */
+typedef struct {
+  void *head;
+  void *tail;
+  size_t count;
+} lreclaim_chain_t;
+
+/* Everything the evaluator's thread still has to do for one dead block */
+typedef struct lreclaim_batch {
+  struct lreclaim_batch *next;
+
+  /* Children still shared with live values, each owed an lval_del() */
+  lval_t **shared;
+  size_t sharedCount;
+  size_t sharedCapacity;
+
+  lreclaim_chain_t nodes;
+  lreclaim_chain_t embedded;
+
+  /* Array memory freed, which lalloc counted against this thread */
+  size_t arrayBytes;
+} lreclaim_batch_t;
+
+/* Both queues are lock-free stacks: dead blocks are linked through their
+ * forward field, batches through next */
+static _Atomic(lval_cells_t *) incoming = NULL;
+static _Atomic(lreclaim_batch_t *) returned = NULL;
+static atomic_int stopping = 0;
+
+static sem_t wakeup;
+static pthread_t thread;
+static int running = 0;
+static int stopped = 0;
+
+static void lreclaim_chain(lreclaim_chain_t *chain, void *ptr) {
+  *(void **) ptr = chain->head;
+  if (chain->head == NULL) {
+    chain->tail = ptr;
+  }
+
+  chain->head = ptr;
+  chain->count++;
+}
+
+/* What a batch took from lalloc_raw(). It is allocated on the reclaimer's
+ * thread and freed on the evaluator's, so the count moves along with it. */
+static size_t lreclaim_batch_bytes(lreclaim_batch_t *batch) {
+  return sizeof(lreclaim_batch_t) + sizeof(lval_t *) * batch->sharedCapacity;
+}
+
+static void lreclaim_share(lreclaim_batch_t *batch, lval_t *val) {
+  if (batch->sharedCount == batch->sharedCapacity) {
+    size_t capacity = batch->sharedCapacity ? batch->sharedCapacity * 2 : 16;
+    lval_t **shared = lalloc_raw(sizeof(lval_t *) * capacity);
+
+    if (batch->shared != NULL) {
+      memcpy(shared, batch->shared, sizeof(lval_t *) * batch->sharedCount);
+      lalloc_raw_free(batch->shared, sizeof(lval_t *) * batch->sharedCapacity);
+    }
+
+    batch->shared = shared;
+    batch->sharedCapacity = capacity;
+  }
+
+  batch->shared[batch->sharedCount++] = val;
+}
+
+/* Counts keep changing on the evaluator's thread while this one reads them.
+ * Acquiring pairs with the release in lval_refs_set(), so a count read here
+ * comes with everything the evaluator did to the node or block before it. */
+static uint32_t lreclaim_refs(lval_refs_t *refs) {
+  return atomic_load_explicit(refs, memory_order_acquire);
+}
+
+/* Whether nothing but garbage can reach val, so the reclaimer may free it.
+ * Sets *cells to the block that goes with it, if any. A count of one can't
+ * go up again, since its only reference is the dead block being walked. A
+ * higher one may drop while we look, which at worst leaves lreclaim_drain()
+ * to release something that could have been freed here. */
+static int lreclaim_owned(lval_t *val, lval_cells_t **cells) {
+  *cells = NULL;
+
+  if (lreclaim_refs(&val->refs) != 1 || (val->flags & ~LVAL_F_EMBEDDED)) {
+    return 0;
+  }
+
+  if (val->type != LVAL_SEXPR && val->type != LVAL_QEXPR) {
+    return 1;
+  }
+
+  lval_cells_t *view = lval_cells(val);
+
+  /* An embedded node shares its memory with its own block, which must either
+   * be the one it looks at or already be dead, see lval.c */
+  if (val->flags & LVAL_F_EMBEDDED) {
+    lval_cells_t *own = (lval_cells_t *) ((char *) val + sizeof(lval_t));
+
+    if (view == own) {
+      *cells = view;
+      return lreclaim_refs(&view->refs) == 1;
+    }
+
+    if (lreclaim_refs(&own->refs) != 0) {
+      return 0;
+    }
+  }
+
+  if (view != NULL && (lreclaim_refs(&view->refs) != 1 || view->embedded || view->compact)) {
+    return 0;
+  }
+
+  *cells = view;
+  return 1;
+}
+
+/* Walks a dead block depth first, with its own forward fields as the stack */
+static lreclaim_batch_t *lreclaim_block(lval_cells_t *cells) {
+  lreclaim_batch_t *batch = lalloc_raw(sizeof(lreclaim_batch_t));
+  memset(batch, 0, sizeof(lreclaim_batch_t));
+
+  cells->forward = NULL;
+  lval_cells_t *stack = cells;
+
+  while (stack != NULL) {
+    lval_cells_t *dead = stack;
+    stack = dead->forward;
+
+    for (int i = dead->lo; i < dead->hi; i++) {
+      lval_t *child = dead->slots[i];
+      if (lval_is_fixnum(child)) {
+        continue;
+      }
+
+      lval_cells_t *owned;
+      if (!lreclaim_owned(child, &owned)) {
+        lreclaim_share(batch, child);
+        continue;
+      }
+
+      if (owned != NULL) {
+        owned->forward = stack;
+        stack = owned;
+      }
+
+      /* An embedded node looking at its own block goes along with it */
+      if (!(child->flags & LVAL_F_EMBEDDED)) {
+        lreclaim_chain(&batch->nodes, child);
+      } else if ((char *) owned != (char *) child + sizeof(lval_t)) {
+        lreclaim_chain(&batch->embedded, child);
+      }
+    }
+
+    if (dead->embedded) {
+      lreclaim_chain(&batch->embedded, (char *) dead - sizeof(lval_t));
+    } else {
+      size_t size = sizeof(lval_cells_t) + sizeof(lval_t *) * dead->capacity;
+      batch->arrayBytes += lalloc_array_size(size);
+      lalloc_array_free(dead, size);
+    }
+  }
+
+  lalloc_account(-(ptrdiff_t) lreclaim_batch_bytes(batch));
+  return batch;
+}
+
+static void *lreclaim_main(void *arg) {
+#ifdef SCHED_IDLE
+  /* Garbage can wait: never take a core away from the evaluator */
+  struct sched_param param = { 0 };
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+  while (1) {
+    sem_wait(&wakeup);
+
+    lval_cells_t *work = atomic_exchange(&incoming, NULL);
+    while (work != NULL) {
+      lval_cells_t *next = work->forward;
+      lreclaim_batch_t *batch = lreclaim_block(work);
+
+      batch->next = atomic_load(&returned);
+      while (!atomic_compare_exchange_weak(&returned, &batch->next, batch)) {
+      }
+
+      work = next;
+    }
+
+    if (atomic_load(&stopping) && atomic_load(&incoming) == NULL) {
+      break;
+    }
+  }
+
+  /* Array caches are per thread and would die with it */
+  lalloc_array_release();
+  return NULL;
+}
+
+int lreclaim_offer(lval_cells_t *cells) {
+  if (stopped || cells->embedded || cells->hi - cells->lo < LRECLAIM_MIN_CELLS) {
+    return 0;
+  }
+
+  if (!running) {
+    sem_init(&wakeup, 0, 0);
+    if (pthread_create(&thread, NULL, lreclaim_main, NULL) != 0) {
+      stopped = 1;
+      return 0;
+    }
+
+    running = 1;
+  }
+
+  cells->forward = atomic_load(&incoming);
+  while (!atomic_compare_exchange_weak(&incoming, &cells->forward, cells)) {
+  }
+
+  sem_post(&wakeup);
+  return 1;
+}
+
+/* Finish off whatever the reclaimer handed back. Only call this from the
+ * evaluator's thread. */
+void lreclaim_drain() {
+  lreclaim_batch_t *batch = atomic_exchange(&returned, NULL);
+
+  while (batch != NULL) {
+    lreclaim_batch_t *next = batch->next;
+
+    lalloc_free_chain(batch->nodes.head, batch->nodes.tail,
+        batch->nodes.count, sizeof(lval_t));
+    lalloc_free_chain(batch->embedded.head, batch->embedded.tail,
+        batch->embedded.count, LVAL_EMBEDDED_SIZE);
+    lalloc_account(-(ptrdiff_t) batch->arrayBytes);
+
+    for (size_t i = 0; i < batch->sharedCount; i++) {
+      lval_del(batch->shared[i]);
+    }
+
+    lalloc_account((ptrdiff_t) lreclaim_batch_bytes(batch));
+    lalloc_raw_free(batch->shared, sizeof(lval_t *) * batch->sharedCapacity);
+    lalloc_raw_free(batch, sizeof(lreclaim_batch_t));
+    batch = next;
+  }
+}
+
+/* Wait for the reclaimer to finish and stop it. Blocks freed from here on
+ * are released inline. */
+void lreclaim_release() {
+  if (running) {
+    atomic_store(&stopping, 1);
+    sem_post(&wakeup);
+    pthread_join(thread, NULL);
+    sem_destroy(&wakeup);
+    running = 0;
+  }
+
+  stopped = 1;
+  lreclaim_drain();
+}
+
+#endif
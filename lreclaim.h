@@ -0,0 +1,31 @@
+/*
+ * Optional background reclaimer, enabled by compiling with -DLRECLAIM.
+ *
+ * When the last reference to a big list block goes away, lval_del() hands
+ * it to a reclaimer thread through a lock-free queue instead of releasing
+ * every child itself, so how long a delete takes no longer depends on how
+ * much garbage it leaves behind.
+ *
+ * The reclaimer only frees what the dead block owns outright: children and
+ * blocks with a single reference, which nothing else can reach. Anything
+ * shared with live values, compacted or hash-consed is handed back through
+ * a second queue, together with the slab memory it freed (lalloc itself is
+ * single-threaded), and lreclaim_drain() finishes the job on the evaluator's
+ * thread at a safe point.
+ *
+ * Can't be combined with -DLGC, whose nursery resets would pull young nodes
+ * out from under the reclaimer. Without -DLRECLAIM every function here is a
+ * no-op.
+ *
+ * Include after lval.h.
+ */
+
+/* Blocks with fewer children than this are released on the spot */
+#ifndef LRECLAIM_MIN_CELLS
+#define LRECLAIM_MIN_CELLS 64
+#endif
+
+/* Takes over a dead block, returning 0 if it should be released inline */
+int lreclaim_offer(lval_cells_t *cells);
+void lreclaim_drain();
+void lreclaim_release();
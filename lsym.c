@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "lalloc.h"
+#include "lsym.h"
+
+#define LSYM_INITIAL_CAPACITY 256
+
+/* The name is stored inline after the header, so an interned pointer can be
+ * turned back into its entry with a fixed offset */
+typedef struct {
+  unsigned long hash;
+  size_t len;
+  char name[];
+} lsym_entry_t;
+
+/* Open-addressed with linear probing; capacity is always a power of two and
+ * the table is never more than half full */
+static lsym_entry_t **table = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+
+/* 64-bit FNV-1a */
+static unsigned long lsym_hash_str(const char *name, size_t len) {
+  unsigned long hash = 14695981039346656037UL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+static void lsym_grow() {
+  size_t newCapacity = capacity ? capacity * 2 : LSYM_INITIAL_CAPACITY;
+  lsym_entry_t **newTable = lalloc_raw(sizeof(lsym_entry_t *) * newCapacity);
+  memset(newTable, 0, sizeof(lsym_entry_t *) * newCapacity);
+
+  /* Rehash using the stored hashes, no string work needed */
+  for (size_t i = 0; i < capacity; i++) {
+    lsym_entry_t *entry = table[i];
+    if (entry == NULL) {
+      continue;
+    }
+
+    size_t slot = entry->hash & (newCapacity - 1);
+    while (newTable[slot] != NULL) {
+      slot = (slot + 1) & (newCapacity - 1);
+    }
+
+    newTable[slot] = entry;
+  }
+
+  lalloc_raw_free(table, sizeof(lsym_entry_t *) * capacity);
+  table = newTable;
+  capacity = newCapacity;
+}
+
+const char *lsym_intern(const char *name) {
+  if ((count + 1) * 2 > capacity) {
+    lsym_grow();
+  }
+
+  size_t len = strlen(name);
+  unsigned long hash = lsym_hash_str(name, len);
+
+  size_t slot = hash & (capacity - 1);
+  while (table[slot] != NULL) {
+    lsym_entry_t *entry = table[slot];
+
+    if (entry->hash == hash && entry->len == len &&
+        memcmp(entry->name, name, len) == 0) {
+      return entry->name;
+    }
+
+    slot = (slot + 1) & (capacity - 1);
+  }
+
+  lsym_entry_t *entry = lalloc_raw(sizeof(lsym_entry_t) + len + 1);
+  entry->hash = hash;
+  entry->len = len;
+  memcpy(entry->name, name, len + 1);
+
+  table[slot] = entry;
+  count++;
+
+  return entry->name;
+}
+
+unsigned long lsym_hash(const char *sym) {
+  const lsym_entry_t *entry =
+    (const lsym_entry_t *) (sym - offsetof(lsym_entry_t, name));
+  return entry->hash;
+}
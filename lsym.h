@@ -0,0 +1,16 @@
+/*
+ * Global symbol interning table.
+ *
+ * Every distinct symbol name is stored exactly once, so two symbols are equal
+ * if and only if their interned pointers are equal. Each entry also carries
+ * its precomputed hash, which hash tables keyed on symbols can read back with
+ * lsym_hash() instead of rehashing the string.
+ *
+ * Interned names live for the lifetime of the process and must never be
+ * freed or modified.
+ */
+
+#include <stddef.h>
+
+const char *lsym_intern(const char *name);
+unsigned long lsym_hash(const char *sym);
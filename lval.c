@@ -1,56 +1,426 @@
 #define _GNU_SOURCE
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "lval.h"
+#include "lalloc.h"
+#include "lsym.h"
+#include "lgc.h"
+#include "lhcons.h"
+#include "lreclaim.h"
+#include "lcensus.h"
+
+lval_cells_t *lval_cells(lval_t *val) {
+  if (val->cell == NULL) {
+    return NULL;
+  }
+
+  return (lval_cells_t *)
+    ((char *) (val->cell - val->offset) - offsetof(lval_cells_t, slots));
+}
+
+/* Largest block the collector will hand out from the nursery */
+#define LVAL_YOUNG_CELLS_MAX 1024
+
+/*
+ * New lists are allocated together with a block of LVAL_EMBEDDED_CELLS
+ * slots placed right after the node, so short expressions only cost one
+ * allocation. The block is still a normal block that other lists can view,
+ * which means node and block can die in either order: the memory is given
+ * back once both reference counts have reached zero.
+ */
+static lval_cells_t *lval_embedded_cells(lval_t *val) {
+  return (lval_cells_t *) ((char *) val + sizeof(lval_t));
+}
+
+static lval_t *lval_embedded_owner(lval_cells_t *cells) {
+  return (lval_t *) ((char *) cells - sizeof(lval_t));
+}
+
+/*
+ * A compacted tree lives in a region: one allocation holding this header and
+ * then every node and block of the tree. References into the region are
+ * counted here, on the whole, so nodes and blocks inside it use their own
+ * refs field to record how far into the region they are instead.
+ */
+typedef struct {
+  size_t refs;
+  size_t size;
+} lval_region_t;
+
+/* Stop compacting trees that would take up more than this, which also keeps
+ * every offset within refs' 32 bits */
+#define LVAL_COMPACT_MAX ((size_t) 16 * 1024 * 1024)
+
+static lval_region_t *lval_region(void *ptr, uint32_t offset) {
+  return (lval_region_t *) ((char *) ptr - offset);
+}
+
+static void lval_region_release(lval_region_t *region) {
+  if (--region->refs == 0) {
+    lcensus_region_free(region->size);
+    lalloc_raw_free(region, region->size);
+  }
+}
+
+static lval_cells_t *lval_cells_init(lval_cells_t *cells, size_t capacity) {
+  cells->embedded = 0;
+  cells->compact = 0;
+  cells->capacity = capacity;
+  cells->lo = 0;
+  cells->hi = 0;
+  lval_refs_set(&cells->refs, 1);
+  cells->old = 0;
+  cells->forward = NULL;
+  return cells;
+}
+
+static size_t lval_cells_bytes(size_t capacity) {
+  return sizeof(lval_cells_t) + sizeof(lval_t *) * capacity;
+}
+
+/* How many slots fit in the array lalloc really hands out for capacity */
+static size_t lval_cells_fit(size_t capacity) {
+  size_t size = lalloc_array_size(lval_cells_bytes(capacity));
+  return (size - sizeof(lval_cells_t)) / sizeof(lval_t *);
+}
+
+static lval_cells_t *lval_cells_new(size_t capacity) {
+#ifdef LGC
+  /* Big blocks would waste most of a nursery chunk, so they go to lalloc */
+  if (capacity <= LVAL_YOUNG_CELLS_MAX) {
+    lval_cells_t *cells = lgc_alloc(lval_cells_bytes(capacity));
+    lcensus_cells_alloc(lval_cells_bytes(capacity));
+    cells->young = 1;
+    return lval_cells_init(cells, capacity);
+  }
+#endif
+
+  capacity = lval_cells_fit(capacity);
+  lval_cells_t *cells = lalloc_array(lval_cells_bytes(capacity));
+  lcensus_cells_alloc(lval_cells_bytes(capacity));
+  cells->young = 0;
+  return lval_cells_init(cells, capacity);
+}
+
+/* Give back the memory of a block nothing refers to any more */
+static void lval_cells_free(lval_cells_t *cells) {
+  /* Look at the owner before marking the block dead: from then on the
+   * reclaimer may be freeing the owner, see lreclaim.h */
+  if (cells->embedded) {
+    lval_t *owner = lval_embedded_owner(cells);
+    int ownerDead = lval_refs_get(&owner->refs) == 0;
+
+    lval_refs_set(&cells->refs, 0);
+    if (ownerDead) {
+      lalloc_free(owner, LVAL_EMBEDDED_SIZE);
+    }
+
+    return;
+  }
+
+  lval_refs_set(&cells->refs, 0);
+  lcensus_cells_free(lval_cells_bytes(cells->capacity));
+
+  /* Young blocks go away with the rest of the nursery */
+  if (cells->young) {
+    return;
+  }
+
+  lalloc_array_free(cells, lval_cells_bytes(cells->capacity));
+}
+
+static void lval_cells_retain(lval_cells_t *cells) {
+  if (cells->compact) {
+    lval_region(cells, cells->refs)->refs++;
+  } else {
+    lval_refs_add(&cells->refs, 1);
+  }
+}
+
+/* Dead blocks whose children still have to be released */
+static lval_cells_t *dead_cells = NULL;
+static int releasing = 0;
+
+static void lval_cells_release(lval_cells_t *cells) {
+  if (cells != NULL && cells->compact) {
+    lval_region_release(lval_region(cells, cells->refs));
+    return;
+  }
+
+  if (cells == NULL || lval_refs_add(&cells->refs, -1) > 0) {
+    return;
+  }
+
+  /* Big blocks can be left to the background reclaimer */
+  if (lreclaim_offer(cells)) {
+    return;
+  }
+
+  /* Dead blocks nested inside this one are queued up rather than released
+   * recursively, so deleting a deep list takes constant stack. Queued blocks
+   * keep a count of one until lval_cells_free(), so the owner of an embedded
+   * block can't free it while it waits. */
+  lval_refs_set(&cells->refs, 1);
+  cells->forward = dead_cells;
+  dead_cells = cells;
+
+  if (releasing) {
+    return;
+  }
+
+  releasing = 1;
+
+  while (dead_cells != NULL) {
+    lval_cells_t *dead = dead_cells;
+    dead_cells = dead->forward;
+
+    for (int i = dead->lo; i < dead->hi; i++) {
+      lval_del(dead->slots[i]);
+    }
+
+    lval_cells_free(dead);
+  }
+
+  releasing = 0;
+}
+
+/* Point a list at count slots of cells, starting offset slots in */
+static void lval_view(lval_t *val, lval_cells_t *cells, int offset, int count) {
+  val->cell = cells->slots + offset;
+  val->offset = offset;
+  val->count = count;
+}
+
+/* Whether a list is the only one looking at its block, and the block holds
+ * nothing outside the list's window, so it can be written to directly */
+static int lval_cells_private(lval_t *val) {
+  lval_cells_t *cells = lval_cells(val);
+
+  return cells == NULL || (!cells->compact && cells->refs == 1 &&
+      cells->lo == val->offset && cells->hi == val->offset + val->count);
+}
+
+/* Make a list's block private to it: copy the window out of a shared block,
+ * or drop whatever the block owns outside the window */
+static void lval_cells_own(lval_t *val) {
+  lval_cells_t *cells = lval_cells(val);
+  if (cells == NULL) {
+    return;
+  }
+
+  if (cells->compact || cells->refs > 1) {
+    lval_cells_t *own = lval_cells_new(val->count < 4 ? 4 : val->count);
+
+    for (int i = 0; i < val->count; i++) {
+      own->slots[i] = lval_copy(val->cell[i]);
+    }
+
+    own->hi = val->count;
+    lval_cells_release(cells);
+    lval_view(val, own, 0, val->count);
+    return;
+  }
+
+  for (int i = cells->lo; i < val->offset; i++) {
+    lval_del(cells->slots[i]);
+  }
+
+  for (int i = val->offset + val->count; i < cells->hi; i++) {
+    lval_del(cells->slots[i]);
+  }
+
+  cells->lo = val->offset;
+  cells->hi = val->offset + val->count;
+  cells->old = 0;
+}
+
+void lval_reserve(lval_t *val, int n) {
+  lval_cells_t *cells = lval_cells(val);
+  size_t capacity = cells ? cells->capacity : 0;
+  size_t needed = (size_t) val->count + n;
+
+  if (val->offset + needed <= capacity) {
+    return;
+  }
+
+  /* Reuse the space left by front pops if that frees up enough of it */
+  if (needed <= capacity / 2) {
+    memmove(cells->slots, val->cell, sizeof(lval_t *) * val->count);
+    cells->lo = 0;
+    cells->hi = val->count;
+    lval_view(val, cells, 0, val->count);
+    return;
+  }
+
+  /* Otherwise grow geometrically, dropping any popped prefix on the way */
+  size_t newCapacity = capacity < 4 ? 4 : capacity * 2;
+  while (newCapacity < needed) {
+    newCapacity *= 2;
+  }
+
+  lval_cells_t *grown;
+  if (cells == NULL) {
+    grown = lval_cells_new(newCapacity);
+  } else if (val->offset == 0 && !cells->young && !cells->embedded) {
+    newCapacity = lval_cells_fit(newCapacity);
+    grown = lalloc_array_realloc(cells, lval_cells_bytes(cells->capacity),
+        lval_cells_bytes(newCapacity));
+    lcensus_cells_free(lval_cells_bytes(grown->capacity));
+    lcensus_cells_alloc(lval_cells_bytes(newCapacity));
+    grown->capacity = newCapacity;
+  } else {
+    grown = lval_cells_new(newCapacity);
+    memcpy(grown->slots, val->cell, sizeof(lval_t *) * val->count);
+    grown->hi = val->count;
+    lval_cells_free(cells);
+  }
+
+  lval_view(val, grown, 0, val->count);
+}
+
+/* ctor names the allocation site, see lcensus.h */
+static lval_t *lval_new(lval_type_t type, const char *ctor) {
+  lval_t *val = lgc_alloc(sizeof(lval_t));
+  val->type = type;
+  val->flags = 0;
+  lval_refs_set(&val->refs, 1);
+  lcensus_alloc(val, ctor);
+  return val;
+}
 
 lval_t *lval_num(long num) {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_NUM;
+  if (num >= LVAL_FIXNUM_MIN && num <= LVAL_FIXNUM_MAX) {
+    return (lval_t *) ((((uintptr_t) num) << 1) | 1);
+  }
+
+  lval_t *val = lval_new(LVAL_NUM, "num");
   val->num = num;
   return val;
 }
 
-lval_t *lval_err(char *msg) {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_ERR;
-  val->err = strdup(msg);
+static lval_t *lval_err_new(lval_err_code_t code, const char *err, int arg) {
+  lval_t *val = lval_new(LVAL_ERR, "err");
+  val->err = err;
+  val->errArg = arg;
+  val->errCode = code;
+  val->errExpected = 0;
+  val->errGot = 0;
+  return val;
+}
+
+/* Messages are borrowed for good, so they have to be string literals */
+lval_t *lval_err(const char *msg) {
+  return lval_err_new(LVAL_ERR_MESSAGE, msg, 0);
+}
+
+lval_t *lval_err_num_args(const char *func, int given, int expected) {
+  assert(expected >= 0 && expected <= UINT16_MAX);
+
+  lval_t *val = lval_err_new(LVAL_ERR_NUM_ARGS, func, given);
+  val->errExpected = expected;
+  return val;
+}
+
+lval_t *lval_err_arg_type(const char *func, int idx, lval_type_t expected, lval_type_t got) {
+  lval_t *val = lval_err_new(LVAL_ERR_ARG_TYPE, func, idx);
+  val->errExpected = expected;
+  val->errGot = got;
   return val;
 }
 
-lval_t *lval_sym(char *sym) {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_SYM;
-  val->sym = strdup(sym);
+lval_t *lval_err_empty_list(const char *func, int idx) {
+  return lval_err_new(LVAL_ERR_EMPTY_LIST, func, idx);
+}
+
+lval_t *lval_sym(const char *sym) {
+  lval_t *val = lval_new(LVAL_SYM, "sym");
+  val->sym = lsym_intern(sym);
   return val;
 }
 
 lval_t *lval_fun(lbuiltin builtin) {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_FUN;
+  lval_t *val = lval_new(LVAL_FUN, "fun");
   val->builtin = builtin;
+  val->nullary = 0;
   return val;
 }
 
-lval_t *lval_sexpr() {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_SEXPR;
+static lval_t *lval_list(lval_type_t type, const char *ctor) {
+#ifdef LGC
+  /* The nursery already makes these allocations cheap, and keeping node and
+   * block apart keeps promotion simple */
+  lval_t *val = lval_new(type, ctor);
   val->count = 0;
+  val->offset = 0;
   val->cell = NULL;
   return val;
+#else
+  lval_t *val = lalloc(LVAL_EMBEDDED_SIZE);
+  val->type = type;
+  val->flags = LVAL_F_EMBEDDED;
+  lval_refs_set(&val->refs, 1);
+
+  lval_cells_t *cells = lval_cells_init(lval_embedded_cells(val), LVAL_EMBEDDED_CELLS);
+  cells->young = 0;
+  cells->embedded = 1;
+  lval_view(val, cells, 0, 0);
+  lcensus_alloc(val, ctor);
+  return val;
+#endif
+}
+
+lval_t *lval_sexpr() {
+  return lval_list(LVAL_SEXPR, "sexpr");
 }
 
 lval_t *lval_qexpr() {
-  lval_t *val = malloc(sizeof(lval_t));
-  val->type = LVAL_QEXPR;
-  val->count = 0;
-  val->cell = NULL;
-  return val;
+  return lval_list(LVAL_QEXPR, "qexpr");
+}
+
+/* Drop a dead list that was allocated along with its first block. Whichever
+ * of the two goes last frees the memory they share. */
+static void lval_del_embedded(lval_t *val) {
+  lval_cells_t *embedded = lval_embedded_cells(val);
+  lval_cells_t *cells = lval_cells(val);
+
+  if (cells == embedded) {
+    lval_cells_release(cells);
+    return;
+  }
+
+  lval_cells_release(cells);
+  if (embedded->refs == 0) {
+    lalloc_free(val, LVAL_EMBEDDED_SIZE);
+  }
 }
 
 void lval_del(lval_t *val) {
+  if (lval_is_fixnum(val)) {
+    return;
+  }
+
+  /* Compacted nodes are only freed along with the rest of their region */
+  if (val->flags & LVAL_F_COMPACT) {
+    lval_region_release(lval_region(val, val->refs));
+    return;
+  }
+
+  /* Only the last reference actually frees anything */
+  if (lval_refs_add(&val->refs, -1) > 0) {
+    return;
+  }
+
+  if (val->flags & LVAL_F_HCONS) {
+    lhcons_forget(val);
+  }
+
+  lcensus_free(val);
+
   switch (val->type) {
     /* Number has nothing special to free */
     case LVAL_NUM: break;
@@ -58,147 +428,816 @@ void lval_del(lval_t *val) {
     /* Function has nothing special to free */
     case LVAL_FUN: break;
 
-    /* Errors and Symbols have strings we need to free */
-    case LVAL_ERR: free(val->err); break;
-    case LVAL_SYM: free(val->sym); break;
+    /* Symbol names are interned and never freed */
+    case LVAL_SYM: break;
+
+    /* Error strings are static */
+    case LVAL_ERR: break;
 
     /* S-Expressions and Q-Expressions have nested values we need to free */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      for (int i = 0; i < val->count; i++) {
-        lval_del(val->cell[i]);
+      if (val->flags & LVAL_F_EMBEDDED) {
+        lval_del_embedded(val);
+        return;
       }
 
-      /* Also free the memory allocated to the pointers */
-      free(val->cell);
+      /* Children belong to the block, which may still be shared */
+      lval_cells_release(lval_cells(val));
       break;
   }
 
-  free(val);
+#ifdef LGC
+  /* Dead young nodes are reclaimed when the nursery is reset */
+  if (!(val->flags & LVAL_F_OLD)) {
+    return;
+  }
+#endif
+
+  lalloc_free(val, sizeof(lval_t));
 }
 
 void lval_add(lval_t *dest, lval_t *src) {
-  dest->count++;
-  dest->cell = realloc(dest->cell, sizeof(lval_t *) * dest->count);
-  dest->cell[dest->count - 1] = src;
+  lval_reserve(dest, 1);
+  dest->cell[dest->count++] = src;
+  lval_cells(dest)->hi++;
 }
 
 lval_t *lval_pop(lval_t *val, int i) {
   lval_t *child = val->cell[i];
+  lval_cells_t *cells = lval_cells(val);
 
-  /* Shift memory after the child backwards to close the gap in the list */
-  memmove(&val->cell[i], &val->cell[i + 1],
-      sizeof(lval_t *) * (val->count - i - 1));
+  if (i == 0) {
+    /* Popping the head only moves the start of the window */
+    val->cell++;
+    val->offset++;
+    cells->lo++;
+  } else {
+    /* Shift memory after the child backwards to close the gap in the list */
+    memmove(&val->cell[i], &val->cell[i + 1],
+        sizeof(lval_t *) * (val->count - i - 1));
+    cells->hi--;
+  }
 
   val->count--;
-  val->cell = realloc(val->cell, sizeof(lval_t *) * val->count);
-
   return child;
 }
 
 lval_t *lval_take(lval_t *val, int i) {
+  /* Someone else still needs the list intact, so share the child instead */
+  if (val->refs > 1 || !lval_cells_private(val)) {
+    lval_t *child = lval_copy(val->cell[i]);
+    lval_del(val);
+    return child;
+  }
+
   lval_t *child = lval_pop(val, i);
   lval_del(val);
   return child;
 }
 
+lval_t *lval_slice(lval_t *val, int start, int count) {
+  lval_cells_t *cells = lval_cells(val);
+  if (cells == NULL) {
+    return val;
+  }
+
+  /* Adjust the window of a list nobody else holds */
+  if (val->refs == 1 && !(val->flags & LVAL_F_OLD)) {
+    lval_view(val, cells, val->offset + start, count);
+    return val;
+  }
+
+  /* Otherwise make a new list looking into the same block */
+  lval_t *view = lval_new(val->type, "slice");
+  lval_cells_retain(cells);
+  lval_view(view, cells, val->offset + start, count);
+  lval_del(val);
+  return view;
+}
+
+lval_t *lval_cons(lval_t *x, lval_t *list) {
+  lval_cells_t *cells = lval_cells(list);
+
+  /* If the list starts where its block's contents do, the free slot just in
+   * front of it can't be seen by any other list, so claim it */
+  if (cells != NULL && !cells->old && cells->lo > 0 && list->offset == cells->lo) {
+    list = lval_slice(list, 0, list->count);
+    cells->lo--;
+    cells->slots[cells->lo] = x;
+    lval_view(list, cells, list->offset - 1, list->count + 1);
+    return list;
+  }
+
+  /* Otherwise copy into a new block, keeping as much free space in front as
+   * the list takes up so the conses that follow are cheap */
+  int count = list->count + 1;
+  lval_cells_t *grown = lval_cells_new(count < 2 ? 4 : count * 2);
+  int offset = grown->capacity - count;
+
+  grown->slots[offset] = x;
+  grown->lo = offset;
+  grown->hi = offset + count;
+
+  if (list->refs == 1 && lval_cells_private(list)) {
+    if (cells != NULL) {
+      memcpy(&grown->slots[offset + 1], list->cell, sizeof(lval_t *) * list->count);
+      cells->hi = cells->lo;
+    }
+  } else {
+    for (int i = 0; i < list->count; i++) {
+      grown->slots[offset + 1 + i] = lval_copy(list->cell[i]);
+    }
+  }
+
+  lval_t *result = lval_new(list->type, "cons");
+  lval_view(result, grown, offset, count);
+  lval_del(list);
+  return result;
+}
+
 lval_t *lval_join(lval_t *a, lval_t *b) {
-  /* Move all items from b -> a */
-  while (b->count > 0) {
-    lval_add(a, lval_pop(b, 0));
+  int moveItems = b->refs == 1 && lval_cells_private(b);
+  lval_cells_t *cells = lval_cells(a);
+
+  /* If a ends where its block's contents do and there's room after it, append
+   * in place; no other list can see those slots. Otherwise fall back to a
+   * private copy of a with enough room. */
+  if (cells != NULL && !cells->old && a->offset + a->count == cells->hi &&
+      cells->hi + b->count <= cells->capacity) {
+    a = lval_slice(a, 0, a->count);
+  } else {
+    a = lval_unshare(a);
+    lval_reserve(a, b->count);
+    cells = lval_cells(a);
   }
 
+  if (b->count == 0) {
+    lval_del(b);
+    return a;
+  }
+
+  if (moveItems) {
+    /* Move all items from b -> a */
+    memcpy(&a->cell[a->count], b->cell, sizeof(lval_t *) * b->count);
+    lval_cells(b)->hi = lval_cells(b)->lo;
+  } else {
+    /* A shared b has to stay intact, so add references to its items instead */
+    for (int i = 0; i < b->count; i++) {
+      a->cell[a->count + i] = lval_copy(b->cell[i]);
+    }
+  }
+
+  a->count += b->count;
+  cells->hi += b->count;
+
   lval_del(b);
   return a;
 }
 
 lval_t *lval_copy(lval_t *old) {
-  lval_t *new = malloc(sizeof(lval_t));
-  new->type = old->type;
+  /* Immediates are their own copy */
+  if (lval_is_fixnum(old)) {
+    return old;
+  }
+
+  if (old->flags & LVAL_F_COMPACT) {
+    lval_region(old, old->refs)->refs++;
+  } else {
+    lval_refs_add(&old->refs, 1);
+  }
+
+  return old;
+}
 
-  switch (old->type) {
-    /* Copy numbers and functions as-is */
-    case LVAL_NUM: new->num = old->num; break;
-    case LVAL_FUN: new->builtin = old->builtin; break;
+lval_t *lval_unshare(lval_t *val) {
+  if (lval_is_fixnum(val)) {
+    return val;
+  }
+
+  /* Promoted nodes are never written to, even by their only owner */
+  if (val->refs == 1 && !(val->flags & LVAL_F_OLD)) {
+    if (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) {
+      lval_cells_own(val);
+    }
+
+    return val;
+  }
+
+  lval_t *new = lval_new(val->type, "unshare");
 
-    /* Copy error and symbol strings */
-    case LVAL_ERR: new->err = strdup(old->err); break;
-    case LVAL_SYM: new->sym = strdup(old->sym); break;
+  switch (val->type) {
+    /* Copy numbers, functions and interned symbols as-is */
+    case LVAL_NUM: new->num = val->num; break;
+    case LVAL_SYM: new->sym = val->sym; break;
+    case LVAL_FUN:
+      new->builtin = val->builtin;
+      new->nullary = val->nullary;
+      break;
+
+    /* Error strings are static, so the whole payload copies as-is */
+    case LVAL_ERR:
+      new->err = val->err;
+      new->errArg = val->errArg;
+      new->errCode = val->errCode;
+      new->errExpected = val->errExpected;
+      new->errGot = val->errGot;
+      break;
 
-    /* Copy lists by recursively copying subexpressions */
+    /* Look at the same block for now, and take a private copy of it below
+     * once the original's reference is gone */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      new->count = old->count;
-      new->cell = malloc(sizeof(lval_t *) * old->count);
+      new->count = 0;
+      new->offset = 0;
+      new->cell = NULL;
 
-      for (int i = 0; i < old->count; i++) {
-        new->cell[i] = lval_copy(old->cell[i]);
+      if (val->cell != NULL) {
+        lval_cells_retain(lval_cells(val));
+        lval_view(new, lval_cells(val), val->offset, val->count);
       }
 
       break;
   }
 
+  /* Drop the caller's reference to the original */
+  lval_del(val);
+
+  if (new->type == LVAL_SEXPR || new->type == LVAL_QEXPR) {
+    lval_cells_own(new);
+  }
+
   return new;
 }
 
-char *lval_type_desc(lval_type_t type) {
+/* A list whose children are being walked, next one first, along with the
+ * block its copy's children go into */
+typedef struct {
+  lval_t *list;
+  lval_cells_t *cells;
+  int next;
+} lval_compact_frame_t;
+
+/* Deeper trees than this take their frames from the heap */
+#define LVAL_COMPACT_STACK_SIZE 32
+
+/* Pushes a frame for a list that has children, growing frames as needed, so
+ * walking a tree takes constant C stack however deep it is */
+static lval_compact_frame_t *lval_compact_push(lval_compact_frame_t *frames,
+    lval_compact_frame_t *small, int *capacity, int *depth, lval_t *list,
+    lval_cells_t *cells) {
+  if (*depth == *capacity) {
+    lval_compact_frame_t *grown = lalloc_raw(sizeof(lval_compact_frame_t) * *capacity * 2);
+    memcpy(grown, frames, sizeof(lval_compact_frame_t) * *capacity);
+
+    if (frames != small) {
+      lalloc_raw_free(frames, sizeof(lval_compact_frame_t) * *capacity);
+    }
+
+    frames = grown;
+    *capacity *= 2;
+  }
+
+  frames[*depth].list = list;
+  frames[*depth].cells = cells;
+  frames[*depth].next = 0;
+  (*depth)++;
+  return frames;
+}
+
+static int lval_compact_has_children(lval_t *val) {
+  return !lval_is_fixnum(val) && (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR)
+    && val->count > 0;
+}
+
+/* Space one node and its block take once compacted, leaving out children */
+static size_t lval_compact_node_size(lval_t *val) {
+  if (lval_is_fixnum(val)) {
+    return 0;
+  }
+
+  if (lval_compact_has_children(val)) {
+    return sizeof(lval_t) + sizeof(lval_cells_t) + sizeof(lval_t *) * val->count;
+  }
+
+  return sizeof(lval_t);
+}
+
+/* Whether copying val out would leave other values holding the original, or
+ * would copy something that is already laid out once */
+static int lval_compact_shared(lval_t *val) {
+  if (lval_is_fixnum(val)) {
+    return 0;
+  }
+
+  if (val->flags & (LVAL_F_COMPACT | LVAL_F_HCONS)) {
+    return 1;
+  }
+
+  if (val->refs > 1) {
+    return 1;
+  }
+
+  return (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) && !lval_cells_private(val);
+}
+
+/* Adds up the space val takes once compacted, giving up past the limit or at
+ * the first shared descendant, either of which returns more than the limit */
+static size_t lval_compact_size(lval_t *val) {
+  lval_compact_frame_t small[LVAL_COMPACT_STACK_SIZE];
+  lval_compact_frame_t *frames = small;
+  int capacity = LVAL_COMPACT_STACK_SIZE;
+  int depth = 0;
+
+  size_t size = sizeof(lval_region_t) + lval_compact_node_size(val);
+  if (lval_compact_has_children(val)) {
+    frames = lval_compact_push(frames, small, &capacity, &depth, val, NULL);
+  }
+
+  while (depth > 0 && size <= LVAL_COMPACT_MAX) {
+    lval_compact_frame_t *frame = &frames[depth - 1];
+    if (frame->next == frame->list->count) {
+      depth--;
+      continue;
+    }
+
+    lval_t *child = frame->list->cell[frame->next++];
+    if (lval_compact_shared(child)) {
+      size = LVAL_COMPACT_MAX + 1;
+      break;
+    }
+
+    size += lval_compact_node_size(child);
+
+    if (lval_compact_has_children(child)) {
+      frames = lval_compact_push(frames, small, &capacity, &depth, child, NULL);
+    }
+  }
+
+  if (frames != small) {
+    lalloc_raw_free(frames, sizeof(lval_compact_frame_t) * capacity);
+  }
+
+  return size;
+}
+
+/* Copies one node into the region at next, along with an empty block for
+ * its children if it has any */
+static lval_t *lval_compact_node(lval_t *val, lval_region_t *region, char **next) {
+  if (lval_is_fixnum(val)) {
+    return val;
+  }
+
+  lval_t *copy = (lval_t *) *next;
+  *next += sizeof(lval_t);
+
+  *copy = *val;
+  copy->flags = LVAL_F_OLD | LVAL_F_COMPACT;
+  lval_refs_set(&copy->refs, (uint32_t) ((char *) copy - (char *) region));
+
+  if (val->type != LVAL_SEXPR && val->type != LVAL_QEXPR) {
+    return copy;
+  }
+
+  copy->offset = 0;
+  copy->cell = NULL;
+
+  if (val->count == 0) {
+    return copy;
+  }
+
+  lval_cells_t *cells = (lval_cells_t *) *next;
+  *next += sizeof(lval_cells_t) + sizeof(lval_t *) * val->count;
+
+  lval_cells_init(cells, val->count);
+  cells->compact = 1;
+  cells->young = 0;
+  cells->old = 1;
+  cells->hi = val->count;
+  lval_refs_set(&cells->refs, (uint32_t) ((char *) cells - (char *) region));
+  lval_view(copy, cells, 0, val->count);
+  return copy;
+}
+
+/* Lays val out in the region in depth-first order, each node followed by
+ * its block */
+static lval_t *lval_compact_copy(lval_t *val, lval_region_t *region) {
+  lval_compact_frame_t small[LVAL_COMPACT_STACK_SIZE];
+  lval_compact_frame_t *frames = small;
+  int capacity = LVAL_COMPACT_STACK_SIZE;
+  int depth = 0;
+
+  char *next = (char *) (region + 1);
+  lval_t *copy = lval_compact_node(val, region, &next);
+
+  if (lval_compact_has_children(val)) {
+    frames = lval_compact_push(frames, small, &capacity, &depth, val, lval_cells(copy));
+  }
+
+  while (depth > 0) {
+    lval_compact_frame_t *frame = &frames[depth - 1];
+    if (frame->next == frame->list->count) {
+      depth--;
+      continue;
+    }
+
+    int i = frame->next++;
+    lval_t *child = frame->list->cell[i];
+    lval_t *childCopy = lval_compact_node(child, region, &next);
+    frame->cells->slots[i] = childCopy;
+
+    if (lval_compact_has_children(child)) {
+      frames = lval_compact_push(frames, small, &capacity, &depth, child,
+          lval_cells(childCopy));
+    }
+  }
+
+  if (frames != small) {
+    lalloc_raw_free(frames, sizeof(lval_compact_frame_t) * capacity);
+  }
+
+  return copy;
+}
+
+lval_t *lval_compact(lval_t *val) {
+  if (lval_is_fixnum(val) || (val->type != LVAL_SEXPR && val->type != LVAL_QEXPR)) {
+    return val;
+  }
+
+  /* Already the root of its own region, or shared with other values */
+  if ((val->flags & LVAL_F_COMPACT) && val->refs == sizeof(lval_region_t)) {
+    return val;
+  }
+
+  if (val->flags & LVAL_F_HCONS) {
+    return val;
+  }
+
+  /* Copying a list that shares its node or block, or anything below it,
+   * would keep both copies alive and undo the sharing */
+  if (val->refs > 1 || !lval_cells_private(val)) {
+    return val;
+  }
+
+  size_t size = lval_compact_size(val);
+  if (size > LVAL_COMPACT_MAX) {
+    return val;
+  }
+
+  lval_region_t *region = lalloc_raw(size);
+  region->refs = 1;
+  region->size = size;
+  lcensus_region_alloc(size);
+
+  lval_t *copy = lval_compact_copy(val, region);
+
+  lval_del(val);
+  return copy;
+}
+
+/* Pointers lenv_footprint() has already counted, open-addressed and kept at
+ * most half full */
+typedef struct {
+  void **slots;
+  size_t capacity;
+  size_t count;
+} lval_seen_t;
+
+#define LVAL_SEEN_INITIAL_CAPACITY 64
+
+static size_t lval_seen_slot(void *ptr, size_t capacity) {
+  return (size_t) (((uintptr_t) ptr * 11400714819323198485UL) >> 32) & (capacity - 1);
+}
+
+static void lval_seen_grow(lval_seen_t *seen) {
+  size_t capacity = seen->capacity ? seen->capacity * 2 : LVAL_SEEN_INITIAL_CAPACITY;
+  void **slots = lalloc_raw(sizeof(void *) * capacity);
+  memset(slots, 0, sizeof(void *) * capacity);
+
+  for (size_t i = 0; i < seen->capacity; i++) {
+    if (seen->slots[i] == NULL) {
+      continue;
+    }
+
+    size_t slot = lval_seen_slot(seen->slots[i], capacity);
+    while (slots[slot] != NULL) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+
+    slots[slot] = seen->slots[i];
+  }
+
+  if (seen->slots != NULL) {
+    lalloc_raw_free(seen->slots, sizeof(void *) * seen->capacity);
+  }
+
+  seen->slots = slots;
+  seen->capacity = capacity;
+}
+
+/* Whether ptr is new to seen, adding it if so */
+static int lval_seen_add(lval_seen_t *seen, void *ptr) {
+  if ((seen->count + 1) * 2 > seen->capacity) {
+    lval_seen_grow(seen);
+  }
+
+  size_t slot = lval_seen_slot(ptr, seen->capacity);
+  while (seen->slots[slot] != NULL) {
+    if (seen->slots[slot] == ptr) {
+      return 0;
+    }
+
+    slot = (slot + 1) & (seen->capacity - 1);
+  }
+
+  seen->slots[slot] = ptr;
+  seen->count++;
+  return 1;
+}
+
+/* Bytes one node and its block take that seen hasn't counted yet, leaving
+ * out its children. Sets *walk when the children still need counting,
+ * which is only the first time a node is seen. */
+static size_t lval_footprint_node(lval_t *val, lval_seen_t *seen, int *walk) {
+  *walk = 0;
+
+  if (lval_is_fixnum(val)) {
+    return 0;
+  }
+
+  /* A compacted tree is counted whole, as its region */
+  if (val->flags & LVAL_F_COMPACT) {
+    lval_region_t *region = lval_region(val, val->refs);
+    return lval_seen_add(seen, region) ? region->size : 0;
+  }
+
+  if (!lval_seen_add(seen, val)) {
+    return 0;
+  }
+
+  size_t size = (val->flags & LVAL_F_EMBEDDED) ? LVAL_EMBEDDED_SIZE : sizeof(lval_t);
+  if ((val->type != LVAL_SEXPR && val->type != LVAL_QEXPR) || val->cell == NULL) {
+    return size;
+  }
+
+  lval_cells_t *cells = lval_cells(val);
+  if (cells->compact) {
+    lval_region_t *region = lval_region(cells, cells->refs);
+    return lval_seen_add(seen, region) ? size + region->size : size;
+  }
+
+  if (!cells->embedded && lval_seen_add(seen, cells)) {
+    size += lval_cells_bytes(cells->capacity);
+  }
+
+  *walk = val->count > 0;
+  return size;
+}
+
+size_t lenv_footprint(lenv_t *env) {
+  lval_seen_t seen = { NULL, 0, 0 };
+  lval_compact_frame_t small[LVAL_COMPACT_STACK_SIZE];
+  lval_compact_frame_t *frames = small;
+  int capacity = LVAL_COMPACT_STACK_SIZE;
+  int depth = 0;
+  int walk;
+
+  size_t size = sizeof(lenv_t) + sizeof(lenv_entry_t) * env->capacity;
+
+  for (int i = 0; i < env->capacity; i++) {
+    if (env->entries[i].sym == NULL) {
+      continue;
+    }
+
+    lval_t *val = env->entries[i].val;
+    size += lval_footprint_node(val, &seen, &walk);
+    if (walk) {
+      frames = lval_compact_push(frames, small, &capacity, &depth, val, NULL);
+    }
+
+    while (depth > 0) {
+      lval_compact_frame_t *frame = &frames[depth - 1];
+      if (frame->next == frame->list->count) {
+        depth--;
+        continue;
+      }
+
+      lval_t *child = frame->list->cell[frame->next++];
+      size += lval_footprint_node(child, &seen, &walk);
+      if (walk) {
+        frames = lval_compact_push(frames, small, &capacity, &depth, child, NULL);
+      }
+    }
+  }
+
+  if (frames != small) {
+    lalloc_raw_free(frames, sizeof(lval_compact_frame_t) * capacity);
+  }
+
+  if (seen.slots != NULL) {
+    lalloc_raw_free(seen.slots, sizeof(void *) * seen.capacity);
+  }
+
+  return size;
+}
+
+const char *lval_type_desc(lval_type_t type) {
   switch (type) {
-    case LVAL_ERR:   return strdup("Error");
-    case LVAL_NUM:   return strdup("Number");
-    case LVAL_SYM:   return strdup("Symbol");
-    case LVAL_FUN:   return strdup("Function");
-    case LVAL_SEXPR: return strdup("S-Expression");
-    case LVAL_QEXPR: return strdup("Q-Expression");
+    case LVAL_ERR:   return "Error";
+    case LVAL_NUM:   return "Number";
+    case LVAL_SYM:   return "Symbol";
+    case LVAL_FUN:   return "Function";
+    case LVAL_SEXPR: return "S-Expression";
+    case LVAL_QEXPR: return "Q-Expression";
   }
 
   return NULL;
 }
 
+int lval_err_format(lval_t *val, char *buf, size_t size) {
+  switch ((lval_err_code_t) val->errCode) {
+    case LVAL_ERR_MESSAGE:
+      return snprintf(buf, size, "%s", val->err);
+
+    case LVAL_ERR_NUM_ARGS:
+      return snprintf(buf, size,
+          "Wrong number of arguments for function '%s' (%d for %d)",
+          val->err, val->errArg, val->errExpected);
+
+    case LVAL_ERR_ARG_TYPE:
+      return snprintf(buf, size,
+          "Invalid type for argument %d to function '%s' (expected: '%s', got: '%s')",
+          val->errArg, val->err, lval_type_desc(val->errExpected),
+          lval_type_desc(val->errGot));
+
+    case LVAL_ERR_EMPTY_LIST:
+      return snprintf(buf, size,
+          "Function '%s' cannot operate on empty lists, an empty list was found at argument %d",
+          val->err, val->errArg);
+  }
+
+  return snprintf(buf, size, "Unknown error");
+}
+
+#define LENV_INITIAL_CAPACITY 16
+
+/* Reads after which a value is compacted, see lenv_touch() */
+#define LENV_COMPACT_READS 2
+
 lenv_t *lenv_new() {
-  lenv_t *env = malloc(sizeof(lenv_t));
+  lenv_t *env = lalloc_raw(sizeof(lenv_t));
   env->count = 0;
-  env->syms = NULL;
-  env->vals = NULL;
+  env->capacity = LENV_INITIAL_CAPACITY;
+  env->version = 0;
+  env->entries = lalloc_raw(sizeof(lenv_entry_t) * env->capacity);
+  memset(env->entries, 0, sizeof(lenv_entry_t) * env->capacity);
   return env;
 }
 
 void lenv_del(lenv_t *env) {
-  for (int i = 0; i < env->count; i++) {
-    free(env->syms[i]);
-    lval_del(env->vals[i]);
+  for (int i = 0; i < env->capacity; i++) {
+    if (env->entries[i].sym != NULL) {
+      lval_del(env->entries[i].val);
+    }
   }
 
-  free(env->syms);
-  free(env->vals);
-  free(env);
+  lalloc_raw_free(env->entries, sizeof(lenv_entry_t) * env->capacity);
+  lalloc_raw_free(env, sizeof(lenv_t));
 }
 
-lval_t *lenv_get(lenv_t *env, lval_t *key) {
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      return lval_copy(env->vals[i]);
+/* Returns the slot holding sym, or the empty slot where it would go */
+static lenv_entry_t *lenv_find(lenv_t *env, const char *sym) {
+  size_t mask = env->capacity - 1;
+  size_t slot = lsym_hash(sym) & mask;
+
+  while (env->entries[slot].sym != NULL && env->entries[slot].sym != sym) {
+    slot = (slot + 1) & mask;
+  }
+
+  return &env->entries[slot];
+}
+
+static void lenv_grow(lenv_t *env) {
+  lenv_entry_t *old = env->entries;
+  int oldCapacity = env->capacity;
+
+  env->capacity *= 2;
+  env->entries = lalloc_raw(sizeof(lenv_entry_t) * env->capacity);
+  memset(env->entries, 0, sizeof(lenv_entry_t) * env->capacity);
+
+  for (int i = 0; i < oldCapacity; i++) {
+    if (old[i].sym != NULL) {
+      *lenv_find(env, old[i].sym) = old[i];
     }
   }
 
-  return lval_err("unbound symbol");
+  lalloc_raw_free(old, sizeof(lenv_entry_t) * oldCapacity);
 }
 
-void lenv_put(lenv_t *env, lval_t *key, lval_t *val) {
-  /* Try to replace the existing entry */
-  for (int i = 0; i < env->count; i++) {
-    if (strcmp(env->syms[i], key->sym) == 0) {
-      lval_del(env->vals[i]);
-      env->vals[i] = lval_copy(val);
-      return;
+lval_t *lenv_borrow(lenv_t *env, const char *sym) {
+  return lenv_find(env, sym)->val;
+}
+
+lval_t *lenv_touch(lenv_t *env, const char *sym) {
+  lenv_entry_t *entry = lenv_find(env, sym);
+
+  /* Values are only compacted once they are read again and again. One that
+   * is read once and then replaced, like l in (def {l} (join l {1})), would
+   * otherwise be copied in full by every def. */
+  if (entry->val != NULL && entry->reads < LENV_COMPACT_READS
+      && ++entry->reads == LENV_COMPACT_READS) {
+    lval_t *val = lval_compact(entry->val);
+
+    /* Anything borrowed before is gone */
+    if (val != entry->val) {
+      entry->val = val;
+      env->version++;
     }
   }
 
-  /* Resize to make room for the new entry */
+  return entry->val;
+}
+
+unsigned long lenv_stamp(lenv_t *env, const char *sym) {
+  lenv_entry_t *entry = lenv_find(env, sym);
+  return entry->sym != NULL ? entry->stamp : 0;
+}
+
+lval_t *lenv_get(lenv_t *env, lval_t *key) {
+  lval_t *val = lenv_touch(env, key->sym);
+
+  if (val != NULL) {
+    return lval_copy(val);
+  }
+
+  return lval_err("unbound symbol");
+}
+
+void lenv_put_move(lenv_t *env, const char *sym, lval_t *val) {
+  lenv_entry_t *entry = lenv_find(env, sym);
+  val = lhcons(val);
+  env->version++;
+
+  /* Replace the existing entry */
+  if (entry->sym != NULL) {
+    lval_del(entry->val);
+    entry->val = val;
+    entry->reads = 0;
+    entry->stamp = env->version;
+    return;
+  }
+
+  /* Grow before crossing half full, which moves every entry */
+  if ((env->count + 1) * 2 > env->capacity) {
+    lenv_grow(env);
+    entry = lenv_find(env, sym);
+  }
+
+  entry->sym = sym;
+  entry->val = val;
+  entry->reads = 0;
+  entry->stamp = env->version;
   env->count++;
-  env->syms = realloc(env->syms, sizeof(char *) * env->count);
-  env->vals = realloc(env->vals, sizeof(lval_t *) * env->count);
+}
+
+void lenv_put(lenv_t *env, lval_t *key, lval_t *val) {
+  lenv_put_move(env, key->sym, lval_copy(val));
+}
+
+int lenv_remove(lenv_t *env, lval_t *key) {
+  lenv_entry_t *entry = lenv_find(env, key->sym);
+  if (entry->sym == NULL) {
+    return 0;
+  }
+
+  lval_del(entry->val);
+  env->count--;
+  env->version++;
+
+  /* Backward-shift deletion: walk the rest of the probe run and move back any
+   * entry whose home slot doesn't lie in the gap we'd otherwise leave */
+  size_t mask = env->capacity - 1;
+  size_t hole = entry - env->entries;
+  size_t slot = hole;
+
+  while (1) {
+    slot = (slot + 1) & mask;
+    if (env->entries[slot].sym == NULL) {
+      break;
+    }
+
+    size_t home = lsym_hash(env->entries[slot].sym) & mask;
+
+    /* Leave the entry alone if its home lies cyclically in (hole, slot] */
+    if (((slot - home) & mask) < ((slot - hole) & mask)) {
+      continue;
+    }
+
+    env->entries[hole] = env->entries[slot];
+    hole = slot;
+  }
 
-  /* Copy the entry in */
-  env->syms[env->count - 1] = strdup(key->sym);
-  env->vals[env->count - 1] = lval_copy(val);
+  env->entries[hole].sym = NULL;
+  env->entries[hole].val = NULL;
+  return 1;
 }
@@ -1,3 +1,51 @@
+#include <stdint.h>
+#include <limits.h>
+
+/* Every file that tests for the collector includes this header first, so
+ * the region mode of lgc.h turns on LGC here rather than there */
+#if defined(LGC_REGION) && !defined(LGC)
+#define LGC
+#endif
+
+/*
+ * Reference counts are only ever changed on the evaluator's thread, but with
+ * LRECLAIM the reclaimer thread reads them while it walks dead blocks, see
+ * lreclaim.c. There they are atomic. The one writer loads and stores rather
+ * than paying for a locked read-modify-write, and its stores release, so a
+ * reclaimer that acquires a count also sees everything done to the node or
+ * block before it changed.
+ */
+#ifdef LRECLAIM
+#include <stdatomic.h>
+
+typedef _Atomic uint32_t lval_refs_t;
+
+static inline uint32_t lval_refs_get(lval_refs_t *refs) {
+  return atomic_load_explicit(refs, memory_order_relaxed);
+}
+
+static inline void lval_refs_set(lval_refs_t *refs, uint32_t count) {
+  atomic_store_explicit(refs, count, memory_order_release);
+}
+#else
+typedef uint32_t lval_refs_t;
+
+static inline uint32_t lval_refs_get(lval_refs_t *refs) {
+  return *refs;
+}
+
+static inline void lval_refs_set(lval_refs_t *refs, uint32_t count) {
+  *refs = count;
+}
+#endif
+
+/* Adds n to a count, returning what it is now */
+static inline uint32_t lval_refs_add(lval_refs_t *refs, int n) {
+  uint32_t count = lval_refs_get(refs) + n;
+  lval_refs_set(refs, count);
+  return count;
+}
+
 struct lval;
 struct lenv;
 typedef struct lval lval_t;
@@ -14,43 +62,223 @@ typedef enum {
 
 typedef lval_t*(*lbuiltin)(lenv_t*, lval_t*);
 
+/* Errors carry a code and the pieces of their message rather than the text
+ * itself, which is only put together by lval_err_format() */
+typedef enum {
+  LVAL_ERR_MESSAGE,    /* err is the whole message */
+  LVAL_ERR_NUM_ARGS,   /* err got errArg arguments, wanted errExpected */
+  LVAL_ERR_ARG_TYPE,   /* argument errArg to err was an errGot, wanted errExpected */
+  LVAL_ERR_EMPTY_LIST  /* argument errArg to err was an empty list */
+} lval_err_code_t;
+
+/*
+ * Only one group of fields is live for a given type, so they share storage.
+ * With a one byte tag this keeps every node at three words.
+ *
+ * Nodes are reference counted: lval_copy() shares a node and lval_del()
+ * drops a reference. A node with more than one reference must be treated as
+ * immutable; call lval_unshare() to get a private copy before changing it.
+ */
 struct lval {
-  lval_type_t type;
+  unsigned char type; /* lval_type_t */
+  unsigned char flags;
+  uint16_t site; /* where it was allocated, see lcensus.h */
+  lval_refs_t refs;
 
-  long num;
-  char *err;
-  char *sym;
-  lbuiltin builtin;
+  union {
+    long num;
+    struct {
+      const char *err; /* static: message or function name */
+      int errArg;
+      uint16_t errExpected; /* an argument count, or an lval_type_t */
+      unsigned char errCode; /* lval_err_code_t */
+      unsigned char errGot;
+    };
+    const char *sym; /* interned, see lsym.h */
+    /* Nullary builtins are called even when they make up a whole
+     * S-Expression on their own, e.g. (gc-stats) */
+    struct {
+      lbuiltin builtin;
+      int nullary;
+    };
 
-  int count;
-  struct lval **cell; /* TODO: Use a linked-list */
+    /* Where a young node was promoted to, see lgc.h */
+    struct lval *forward;
+
+    struct {
+      int count;
+      int offset; /* where cell starts in its lval_cells_t */
+      struct lval **cell;
+    };
+  };
 };
 
-/* TODO: Use an actual hash */
+/*
+ * Storage behind a list's cell pointer. Blocks are reference counted and can
+ * be viewed by several lists at once, each through its own window of
+ * count slots starting offset slots in. The block owns one reference to each
+ * child in slots[lo..hi), a range that covers every window into it, so slots
+ * outside it are free for whichever list reaches them first.
+ */
+typedef struct lval_cells {
+  size_t capacity;
+  int lo;
+  int hi;
+  lval_refs_t refs;
+
+  unsigned char embedded; /* shares an allocation with a list node */
+  unsigned char compact;  /* part of a compacted tree, see lval_compact() */
+
+  /* Collector state, see lgc.h */
+  unsigned char young; /* allocated in the nursery */
+  unsigned char old;   /* promoted, never written to again */
+
+  /* Where a young block was promoted to, or once the block is dead, the next
+   * dead block waiting for its children to be released */
+  struct lval_cells *forward;
+
+  struct lval *slots[];
+} lval_cells_t;
+
+/* Node flags */
+#define LVAL_F_OLD       0x01 /* immutable: promoted or compacted */
+#define LVAL_F_FORWARDED 0x02 /* young node that has been promoted */
+#define LVAL_F_EMBEDDED  0x04 /* allocated together with its first block */
+#define LVAL_F_COMPACT   0x08 /* part of a compacted tree */
+#define LVAL_F_HCONS     0x10 /* canonical node, see lhcons.h */
+
+/* Size of a list node allocated together with its first block */
+#define LVAL_EMBEDDED_CELLS 4
+#define LVAL_EMBEDDED_SIZE \
+  (sizeof(lval_t) + sizeof(lval_cells_t) + sizeof(struct lval *) * LVAL_EMBEDDED_CELLS)
+
+_Static_assert(sizeof(lval_t) <= 3 * sizeof(void *),
+    "lval_t should stay three words wide");
+
+/*
+ * Numbers that fit in LVAL_FIXNUM_MIN..LVAL_FIXNUM_MAX are never allocated.
+ * Instead the value is stored in the pointer word itself, shifted left by one
+ * with the low bit set (real lval_t pointers are always aligned, so their low
+ * bit is clear). Such immediates must only be inspected through lval_type()
+ * and lval_num_value(); lval_copy() and lval_del() are no-ops for them.
+ */
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fixnum(lval_t *val) {
+  return ((uintptr_t) val) & 1;
+}
+
+static inline lval_type_t lval_type(lval_t *val) {
+  return lval_is_fixnum(val) ? LVAL_NUM : val->type;
+}
+
+static inline long lval_num_value(lval_t *val) {
+  return lval_is_fixnum(val) ? (long) (((intptr_t) val) >> 1) : val->num;
+}
+
+typedef struct {
+  const char *sym; /* interned, NULL for an empty slot */
+  lval_t *val;
+  int reads; /* since val was stored, counting up to compaction */
+  unsigned long stamp; /* env's version when val was stored */
+} lenv_entry_t;
+
+/*
+ * Open-addressed hash table keyed on interned symbol pointers, using linear
+ * probing. Capacity is a power of two and the table is kept at most half
+ * full; deletion shifts later entries back instead of leaving tombstones.
+ */
 struct lenv {
   int count;
-  char **syms;
-  lval_t **vals;
+  int capacity;
+  lenv_entry_t *entries;
+  unsigned long version; /* bumped whenever a bound value changes or moves */
 };
 
+/*
+ * Ownership conventions: lval_t arguments are moved into the callee unless
+ * they are documented as borrowed, and returned values belong to the caller.
+ * Borrowed pointers stay valid only until their owner is changed or deleted.
+ */
+
 lval_t *lval_num(long num);
-lval_t *lval_err(char *msg);
-lval_t *lval_sym(char *sym);
+lval_t *lval_err(const char *msg);
+lval_t *lval_err_num_args(const char *func, int given, int expected);
+lval_t *lval_err_arg_type(const char *func, int idx, lval_type_t expected, lval_type_t got);
+lval_t *lval_err_empty_list(const char *func, int idx);
+lval_t *lval_sym(const char *sym);
 lval_t *lval_fun(lbuiltin fun);
 lval_t *lval_sexpr();
 lval_t *lval_qexpr();
 
-void lval_add(lval_t *dest, lval_t *src);
 void lval_del(lval_t *val);
 
-lval_t *lval_take(lval_t *val, int i);
+/* Moves src onto the end of dest. dest must be unshared. */
+void lval_add(lval_t *dest, lval_t *src);
+
+/* Makes room for n more children at the end of val, which must be unshared,
+ * so adding a known number of them grows its block at most once */
+void lval_reserve(lval_t *val, int n);
+
+/* Borrows val, removing and returning its i'th child. val must be unshared. */
 lval_t *lval_pop(lval_t *val, int i);
+lval_t *lval_take(lval_t *val, int i);
+
+/* Persistent list operations: these share storage with their arguments where
+ * they can rather than copying, so slicing is O(1) and consing or joining
+ * onto the newest version of a list only costs what is being added. */
+lval_t *lval_slice(lval_t *val, int start, int count);
+lval_t *lval_cons(lval_t *x, lval_t *list);
 lval_t *lval_join(lval_t *a, lval_t *b);
+
+lval_cells_t *lval_cells(lval_t *val);
+
+/* Borrows old, returning a new reference to it */
 lval_t *lval_copy(lval_t *old);
+lval_t *lval_unshare(lval_t *val);
+
+/* Copies a list and everything below it into one contiguous, immutable
+ * block: nodes in depth-first order, each followed by its cells, freed in a
+ * single call once the last reference into it is gone. Lists that are
+ * already compact or canonical (see lhcons.h), lists that share their node or
+ * block, or anything below them, with other values, other values and very
+ * large trees come back unchanged. */
+lval_t *lval_compact(lval_t *val);
 
-char *lval_type_desc(lval_type_t type);
+const char *lval_type_desc(lval_type_t type);
+
+/* Writes an error's message into buf like snprintf, returning its length */
+int lval_err_format(lval_t *val, char *buf, size_t size);
 
 lenv_t *lenv_new();
-lval_t *lenv_get(lenv_t *env, lval_t *key);
 void lenv_del(lenv_t *env);
+
+/* Keys are borrowed. lenv_get returns a new reference to the bound value and
+ * lenv_put stores a new reference to val, leaving the caller's intact.
+ * lenv_get counts as a read, see lenv_touch. */
+lval_t *lenv_get(lenv_t *env, lval_t *key);
 void lenv_put(lenv_t *env, lval_t *key, lval_t *val);
+int lenv_remove(lenv_t *env, lval_t *key);
+
+/* Variants keyed directly on an interned name. lenv_borrow returns the value
+ * still owned by env (NULL when unbound) and lenv_put_move takes ownership of
+ * val, so neither touches any reference counts. Values are hash-consed on the
+ * way into the environment. lenv_borrow never changes env. */
+lval_t *lenv_borrow(lenv_t *env, const char *sym);
+void lenv_put_move(lenv_t *env, const char *sym, lval_t *val);
+
+/* lenv_borrow for reads by the program itself. Lists are compacted once they
+ * have been read a few times this way, which replaces the bound value and
+ * changes env like a put does, so any value borrowed from env before is
+ * gone. */
+lval_t *lenv_touch(lenv_t *env, const char *sym);
+
+/* The version env was at when sym was last bound, or 0 while it is unbound.
+ * Unlike env->version, this only changes when sym's own value does. */
+unsigned long lenv_stamp(lenv_t *env, const char *sym);
+
+/* Heap bytes env's table and the values bound in it keep alive. Nodes,
+ * blocks and compacted regions are counted once however many values share
+ * them, and the walk takes constant C stack however deep they nest. */
+size_t lenv_footprint(lenv_t *env);
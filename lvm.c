@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lval.h"
+#include "lalloc.h"
+#include "lvm.h"
+#include "lcache.h"
+
+typedef enum {
+  LVM_CONST, /* push a copy of consts[arg] */
+  LVM_LOAD,  /* push the value bound to the symbol consts[arg] */
+  LVM_CALL   /* pop arg values and apply them */
+} lvm_op_t;
+
+/* Each instruction is an opcode in the low byte and its argument above it */
+#define LVM_OP(op, arg) ((uint32_t) (op) | ((uint32_t) (arg) << 8))
+
+/* Deeper stacks than this come from the heap */
+#define LVM_STACK_SIZE 64
+
+/* Code that called eval, to carry on with from pc once the eval is done */
+typedef struct {
+  lvm_code_t *code;
+  lvm_code_t *owned;
+  int pc;
+} lvm_frame_t;
+
+/* Deeper nesting of evals than this takes its frames from the heap */
+#define LVM_FRAMES_SIZE 16
+
+/* Instructions and constants live in the same allocation as the header */
+struct lvm_code {
+  uint32_t refs;
+  size_t size;
+  int maxStack;
+  int opCount;
+  int constCount;
+  uint32_t *ops;
+  lval_t **consts;
+};
+
+/* Counts what a list compiles to, to size the code up front */
+static void lvm_measure(lval_t *list, int *ops, int *consts) {
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    if (lval_type(child) == LVAL_SEXPR) {
+      lvm_measure(child, ops, consts);
+    } else {
+      (*ops)++;
+      (*consts)++;
+    }
+  }
+
+  (*ops)++;
+}
+
+/* depth is how many values are on the stack below this list's */
+static void lvm_emit(lvm_code_t *code, lval_t *list, int depth) {
+  for (int i = 0; i < list->count; i++) {
+    lval_t *child = list->cell[i];
+
+    switch (lval_type(child)) {
+      case LVAL_SEXPR:
+        lvm_emit(code, child, depth + i);
+        break;
+
+      case LVAL_SYM:
+        code->ops[code->opCount++] = LVM_OP(LVM_LOAD, code->constCount);
+        code->consts[code->constCount++] = lval_copy(child);
+        break;
+
+      default:
+        code->ops[code->opCount++] = LVM_OP(LVM_CONST, code->constCount);
+        code->consts[code->constCount++] = lval_copy(child);
+        break;
+    }
+
+    if (depth + i + 1 > code->maxStack) {
+      code->maxStack = depth + i + 1;
+    }
+  }
+
+  code->ops[code->opCount++] = LVM_OP(LVM_CALL, list->count);
+}
+
+lvm_code_t *lvm_compile(lval_t *list) {
+  int ops = 0;
+  int consts = 0;
+  lvm_measure(list, &ops, &consts);
+
+  size_t size = sizeof(lvm_code_t) + sizeof(lval_t *) * consts + sizeof(uint32_t) * ops;
+  lvm_code_t *code = lalloc_raw(size);
+
+  code->refs = 1;
+  code->size = size;
+  code->maxStack = 0;
+  code->opCount = 0;
+  code->constCount = 0;
+  code->consts = (lval_t **) (code + 1);
+  code->ops = (uint32_t *) (code->consts + consts);
+
+  lvm_emit(code, list, 0);
+  return code;
+}
+
+void lvm_code_del(lvm_code_t *code) {
+  if (--code->refs > 0) {
+    return;
+  }
+
+  for (int i = 0; i < code->constCount; i++) {
+    lval_del(code->consts[i]);
+  }
+
+  lalloc_raw_free(code, code->size);
+}
+
+/* Code for eval's argument, if the call about to be made is an eval */
+static lvm_code_t *lvm_eval_code(lval_t **args, uint32_t count, lenv_t *env,
+    lbuiltin apply, lbuiltin eval) {
+  if (count != 2 || lval_type(args[0]) != LVAL_FUN || args[0]->builtin != eval
+      || lval_type(args[1]) != LVAL_QEXPR) {
+    return NULL;
+  }
+
+  lvm_code_t *code = lvm_compile_cached(args[1], env, apply);
+  return code != NULL ? code : lvm_compile(args[1]);
+}
+
+/* Makes room for needed values, keeping the sp already on the stack */
+static lval_t **lvm_reserve(lval_t **stack, lval_t **small, int *capacity,
+    int sp, int needed) {
+  if (needed <= *capacity) {
+    return stack;
+  }
+
+  int grownCapacity = *capacity * 2 > needed ? *capacity * 2 : needed;
+  lval_t **grown = lalloc_raw(sizeof(lval_t *) * grownCapacity);
+  memcpy(grown, stack, sizeof(lval_t *) * sp);
+
+  if (stack != small) {
+    lalloc_raw_free(stack, sizeof(lval_t *) * *capacity);
+  }
+
+  *capacity = grownCapacity;
+  return grown;
+}
+
+lval_t *lvm_run(lvm_code_t *code, lenv_t *env, lbuiltin apply, lbuiltin eval) {
+  lval_t *small[LVM_STACK_SIZE];
+  int capacity = LVM_STACK_SIZE;
+  lval_t **stack = lvm_reserve(small, small, &capacity, 0, code->maxStack);
+
+  lvm_frame_t smallFrames[LVM_FRAMES_SIZE];
+  lvm_frame_t *frames = smallFrames;
+  int frameCapacity = LVM_FRAMES_SIZE;
+  int depth = 0;
+
+  /* Code taken over by an eval, which is ours to delete */
+  lvm_code_t *owned = NULL;
+  int evaled = 0;
+
+  int sp = 0;
+  lval_t *val = NULL;
+
+  for (int pc = 0; ; pc++) {
+    uint32_t op = code->ops[pc];
+    uint32_t arg = op >> 8;
+
+    switch ((lvm_op_t) (op & 0xff)) {
+      case LVM_CONST:
+        val = lval_copy(code->consts[arg]);
+        break;
+
+      case LVM_LOAD:
+        val = lenv_get(env, code->consts[arg]);
+        break;
+
+      case LVM_CALL:
+        sp -= arg;
+
+        lvm_code_t *next = lvm_eval_code(&stack[sp], arg, env, apply, eval);
+        if (next == NULL) {
+          val = lval_sexpr();
+
+          for (uint32_t i = 0; i < arg; i++) {
+            lval_add(val, stack[sp + i]);
+          }
+
+          val = apply(env, val);
+          break;
+        }
+
+        lval_del(stack[sp]);
+        lval_del(stack[sp + 1]);
+
+        /* An eval that ends the code runs in place of it, so chains of evals
+         * run in constant space. Any other one runs above the values already
+         * on the stack and hands its result back to a frame. */
+        if (pc == code->opCount - 1) {
+          if (owned != NULL) {
+            lvm_code_del(owned);
+          }
+        } else {
+          if (depth == frameCapacity) {
+            lvm_frame_t *grown = lalloc_raw(sizeof(lvm_frame_t) * frameCapacity * 2);
+            memcpy(grown, frames, sizeof(lvm_frame_t) * frameCapacity);
+
+            if (frames != smallFrames) {
+              lalloc_raw_free(frames, sizeof(lvm_frame_t) * frameCapacity);
+            }
+
+            frames = grown;
+            frameCapacity *= 2;
+          }
+
+          frames[depth].code = code;
+          frames[depth].owned = owned;
+          frames[depth].pc = pc;
+          depth++;
+        }
+
+        code = owned = next;
+        pc = -1;
+        evaled = 1;
+
+        stack = lvm_reserve(stack, small, &capacity, sp, sp + code->maxStack);
+        continue;
+    }
+
+    /* Every list hands an error straight up, through all the frames */
+    if (lval_type(val) == LVAL_ERR) {
+      break;
+    }
+
+    /* The last call's result is the result of the whole list */
+    if (pc == code->opCount - 1) {
+      if (depth == 0) {
+        break;
+      }
+
+      lvm_code_del(owned);
+
+      depth--;
+      code = frames[depth].code;
+      owned = frames[depth].owned;
+      pc = frames[depth].pc;
+    }
+
+    stack[sp++] = val;
+  }
+
+  while (sp > 0) {
+    lval_del(stack[--sp]);
+  }
+
+  if (stack != small) {
+    lalloc_raw_free(stack, sizeof(lval_t *) * capacity);
+  }
+
+  /* Frames left by an error still own their code */
+  while (depth > 0) {
+    if (owned != NULL) {
+      lvm_code_del(owned);
+    }
+
+    owned = frames[--depth].owned;
+  }
+
+  if (frames != smallFrames) {
+    lalloc_raw_free(frames, sizeof(lvm_frame_t) * frameCapacity);
+  }
+
+  if (owned != NULL) {
+    lvm_code_del(owned);
+  }
+
+  /* The evals that were run in place never went through apply */
+  if (evaled && lalloc_quota_exceeded() && lval_type(val) != LVAL_ERR) {
+    lval_del(val);
+    val = lval_err("Memory quota exceeded!");
+  }
+
+  return val;
+}
+
+static void *lvm_cache_compile(lval_t *list) {
+  return lvm_compile(list);
+}
+
+static void lvm_cache_retain(void *code) {
+  ((lvm_code_t *) code)->refs++;
+}
+
+static void lvm_cache_del(void *code) {
+  lvm_code_del(code);
+}
+
+static const lcache_ops_t lvm_cache_ops = {
+  lvm_cache_compile, lvm_cache_retain, lvm_cache_del
+};
+
+lvm_code_t *lvm_compile_cached(lval_t *list, lenv_t *env, lbuiltin apply) {
+  return lcache_get(list, env, apply, &lvm_cache_ops);
+}
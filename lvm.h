@@ -0,0 +1,35 @@
+/*
+ * Bytecode compiler and stack machine, used instead of the tree walker when
+ * byol is started with --vm.
+ *
+ * A list compiles to straight-line code for a stack machine: each child is
+ * pushed in order (constants as they are, symbols looked up, nested
+ * S-Expressions compiled in place), then a call gathers the values into an
+ * argument list for the evaluator's apply function. The machine never
+ * touches the list it was compiled from, so code can be run any number of
+ * times without copying it.
+ *
+ * Evaluation order, builtins and errors are exactly those of lval_eval():
+ * since every S-Expression hands an erroneous child straight up, the first
+ * error produced anywhere is the result of the whole run.
+ *
+ * Include after lval.h.
+ */
+
+typedef struct lvm_code lvm_code_t;
+
+/* Compiles the evaluation of list, borrowed, as an S-Expression, whatever
+ * its type. Code is reference counted like values are. */
+lvm_code_t *lvm_compile(lval_t *list);
+void lvm_code_del(lvm_code_t *code);
+
+/* apply gets each call's evaluated S-Expression, as lval_eval() would
+ * have it after evaluating the children. Calls to eval run their argument's
+ * code on the machine's own stack instead, as lval_eval() does, so nesting
+ * is only limited by memory. One that ends the code runs in place of it. */
+lval_t *lvm_run(lvm_code_t *code, lenv_t *env, lbuiltin apply, lbuiltin eval);
+
+/* lvm_compile() for immutable lists, folded and remembered for the next time
+ * the same list comes along, see lcache.h. Returns NULL for lists that can't
+ * be cached. */
+lvm_code_t *lvm_compile_cached(lval_t *list, lenv_t *env, lbuiltin apply);
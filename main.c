@@ -8,6 +8,16 @@
 
 #include "mpc.h"
 #include "lval.h"
+#include "lalloc.h"
+#include "lsym.h"
+#include "lgc.h"
+#include "lhcons.h"
+#include "lreclaim.h"
+#include "lcensus.h"
+#include "lvm.h"
+#include "lclos.h"
+#include "lcache.h"
+#include "lfold.h"
 #include "assertions.h"
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -17,18 +27,24 @@ lval_t *ast_node_to_lval(mpc_ast_t *node);
 int is_valid_expr(mpc_ast_t *node);
 
 void lenv_add_builtin(lenv_t *env, char *name, lbuiltin func);
+void lenv_add_nullary_builtin(lenv_t *env, char *name, lbuiltin func);
+void lenv_add_pure_builtin(lenv_t *env, char *name, lbuiltin func);
 void lenv_add_builtins(lenv_t *env);
 
-lval_t *lval_eval_sexpr(lenv_t *env, lval_t *val);
 lval_t *lval_eval(lenv_t *env, lval_t *val);
+lval_t *lval_apply(lenv_t *env, lval_t *val);
 
-lval_t *builtin_func(lenv_t *env, lval_t *val, char *symbol);
-lval_t *builtin_op(lenv_t *env, lval_t *val, char *op);
+/* Arithmetic operators, picked once when a builtin is registered */
+typedef enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MIN, LOP_MAX } lop_t;
+
+lval_t *builtin_op(lenv_t *env, lval_t *val, lop_t op);
 
 lval_t *builtin_add(lenv_t *env, lval_t *val);
 lval_t *builtin_sub(lenv_t *env, lval_t *val);
 lval_t *builtin_mul(lenv_t *env, lval_t *val);
 lval_t *builtin_div(lenv_t *env, lval_t *val);
+lval_t *builtin_min(lenv_t *env, lval_t *val);
+lval_t *builtin_max(lenv_t *env, lval_t *val);
 
 lval_t *builtin_head(lenv_t *env, lval_t *val);
 lval_t *builtin_tail(lenv_t *env, lval_t *val);
@@ -39,15 +55,38 @@ lval_t *builtin_cons(lenv_t *env, lval_t *val);
 lval_t *builtin_len(lenv_t *env, lval_t *val);
 lval_t *builtin_init(lenv_t *env, lval_t *val);
 lval_t *builtin_def(lenv_t *env, lval_t *val);
+lval_t *builtin_gc_stats(lenv_t *env, lval_t *val);
+lval_t *builtin_hcons_stats(lenv_t *env, lval_t *val);
+lval_t *builtin_alloc_stats(lenv_t *env, lval_t *val);
+lval_t *builtin_heap_stats(lenv_t *env, lval_t *val);
+lval_t *builtin_fold_stats(lenv_t *env, lval_t *val);
 
 void lval_print(lval_t *val);
 void lval_expr_print(lval_t *val, char open, char close);
+void lval_err_print(lval_t *val);
 
 int num_leaves(mpc_ast_t *node);
 int num_branches(mpc_ast_t *node);
 int most_children(mpc_ast_t *node);
 
+/* What runs programs: the tree walker, or as set by --closures or --vm the
+ * closure compiler (see lclos.h) or the bytecode compiler (see lvm.h) */
+static enum { EVAL_TREE, EVAL_CLOSURES, EVAL_VM } evaluator = EVAL_TREE;
+
 int main(int argc, char **argv) {
+  /* Bytes each line may allocate beyond what's already live, 0 for no limit */
+  size_t quota = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quota") == 0 && i + 1 < argc) {
+      quota = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--closures") == 0) {
+      evaluator = EVAL_CLOSURES;
+    } else if (strcmp(argv[i], "--vm") == 0) {
+      evaluator = EVAL_VM;
+    }
+  }
+
   puts("BYOL Version 0.0.1");
   puts("Press CTRL-C to Exit\n");
 
@@ -75,17 +114,48 @@ int main(int argc, char **argv) {
 
   while (1) {
     char *input = readline("byol> ");
+
+    /* End of input, e.g. when a script is piped in */
+    if (input == NULL) {
+      putchar('\n');
+      break;
+    }
+
     add_history(input);
 
     mpc_result_t result;
     if (mpc_parse("<stdin>", input, Program, &result)) {
+      lalloc_quota_begin(quota);
+
       lval_t *program = ast_node_to_lval(result.output);
-      lval_t *computedResult = lval_eval(env, program);
+      lval_t *computedResult;
+
+      lfold(&program, env, lval_apply);
+
+      if (evaluator == EVAL_VM) {
+        lvm_code_t *code = lvm_compile(program);
+        lval_del(program);
+
+        computedResult = lvm_run(code, env, lval_apply, builtin_eval);
+        lvm_code_del(code);
+      } else if (evaluator == EVAL_CLOSURES) {
+        lclos_code_t *code = lclos_compile(program);
+        lval_del(program);
+
+        computedResult = lclos_run(code, env, lval_apply, builtin_eval);
+        lclos_code_del(code);
+      } else {
+        computedResult = lval_eval(env, program);
+      }
 
       lval_print(computedResult);
       putchar('\n');
       lval_del(computedResult);
 
+      /* Only the environment is live between evaluations */
+      lgc_collect(env);
+      lreclaim_drain();
+
       /*
       puts("\n\n=== Abstract Syntax Tree ===");
 
@@ -108,7 +178,11 @@ int main(int argc, char **argv) {
     free(input);
   }
 
+  lcache_release();
   lenv_del(env);
+  lreclaim_release();
+  lgc_release();
+  lalloc_release();
 
   mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Program);
 
@@ -180,7 +254,15 @@ lval_t *ast_node_to_lval(mpc_ast_t *node) {
     mpc_ast_t *child = node->children[i];
 
     if (is_valid_expr(child)) {
-      lval_add(val, ast_node_to_lval(child));
+      lval_t *item = ast_node_to_lval(child);
+
+      /* Quoted literals are never evaluated in place, so lay out each
+       * outermost one as a single compact block */
+      if (val->type != LVAL_QEXPR && lval_type(item) == LVAL_QEXPR) {
+        item = lval_compact(item);
+      }
+
+      lval_add(val, item);
     }
   }
 
@@ -198,9 +280,9 @@ int is_valid_expr(mpc_ast_t *node) {
 }
 
 void lval_print(lval_t *val) {
-  switch (val->type) {
-    case LVAL_NUM:   printf("%li", val->num);        break;
-    case LVAL_ERR:   printf("Error: %s", val->err);  break;
+  switch (lval_type(val)) {
+    case LVAL_NUM:   printf("%li", lval_num_value(val)); break;
+    case LVAL_ERR:   lval_err_print(val);            break;
     case LVAL_SYM:   printf("%s", val->sym);         break;
     case LVAL_FUN:   printf("<function>");           break;
     case LVAL_SEXPR: lval_expr_print(val, '(', ')'); break;
@@ -208,6 +290,13 @@ void lval_print(lval_t *val) {
   }
 }
 
+/* Errors are only formatted once they're actually shown */
+void lval_err_print(lval_t *val) {
+  char msg[256];
+  lval_err_format(val, msg, sizeof(msg));
+  printf("Error: %s", msg);
+}
+
 void lval_expr_print(lval_t *val, char open, char close) {
   putchar(open);
 
@@ -223,136 +312,280 @@ void lval_expr_print(lval_t *val, char open, char close) {
   putchar(close);
 }
 
-lval_t *lval_eval_sexpr(lenv_t *env, lval_t *val) {
-  /* Evaluate children */
-  for (int i = 0; i < val->count; i++) {
-    val->cell[i] = lval_eval(env, val->cell[i]);
-
-    /* Check for errors */
-    if (val->cell[i]->type == LVAL_ERR) {
-      return lval_take(val, i);
-    }
-  }
-
+/* Finish evaluating an S-Expression whose children have all been evaluated
+ * without error */
+lval_t *lval_apply(lenv_t *env, lval_t *val) {
   /* Empty expressions */
   if (val->count == 0) {
     return val;
   }
 
-  /* Single expressions */
+  /* Single expressions, unless it's a function that takes no arguments */
   if (val->count == 1) {
-    return lval_take(val, 0);
+    lval_t *only = val->cell[0];
+
+    if (lval_type(only) != LVAL_FUN || !only->nullary) {
+      return lval_take(val, 0);
+    }
   }
 
   /* Ensure first element is a function */
   lval_t *first = lval_pop(val, 0);
-  if (first->type != LVAL_FUN) {
+  if (lval_type(first) != LVAL_FUN) {
     lval_del(first);
     lval_del(val);
     return lval_err("first element is not a function");
   }
 
+  lcensus_poll(env);
+
+  lbuiltin caller = lcensus_enter(first->builtin);
   lval_t *result = first->builtin(env, val);
+  lcensus_leave(caller);
   lval_del(first);
+
+  /* A runaway evaluation is stopped by the first call that goes over, and
+   * the error unwinds everything above it */
+  if (lalloc_quota_exceeded() && lval_type(result) != LVAL_ERR) {
+    lval_del(result);
+    return lval_err("Memory quota exceeded!");
+  }
+
   return result;
 }
 
-lval_t *lval_eval(lenv_t *env, lval_t *val) {
-  if (val->type == LVAL_SYM) {
-    lval_t *resolvedVal = lenv_get(env, val);
-    lval_del(val);
-    return resolvedVal;
-  }
+/* An S-Expression whose children are being evaluated, next one first */
+typedef struct {
+  lval_t *list;
+  int next;
+} leval_frame_t;
 
-  if (val->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(env, val);
-  }
+/* Deeper nesting than this takes its frames from the heap */
+#define LEVAL_STACK_SIZE 32
 
-  return val;
+static void *leval_cache_compile(lval_t *list) {
+  return lval_copy(list);
 }
 
-lval_t *builtin_func(lenv_t *env, lval_t *val, char *symbol) {
-  if (strcmp("list", symbol) == 0) { return builtin_list(env, val); }
-  if (strcmp("head", symbol) == 0) { return builtin_head(env, val); }
-  if (strcmp("tail", symbol) == 0) { return builtin_tail(env, val); }
-  if (strcmp("join", symbol) == 0) { return builtin_join(env, val); }
-  if (strcmp("eval", symbol) == 0) { return builtin_eval(env, val); }
-  if (strcmp("cons", symbol) == 0) { return builtin_cons(env, val); }
-  if (strcmp("len", symbol) == 0)  { return builtin_len(env, val);  }
-  if (strcmp("init", symbol) == 0) { return builtin_init(env, val); }
+static void leval_cache_retain(void *body) {
+  lval_copy(body);
+}
 
-  if (strcmp("min", symbol) == 0 || strcmp("max", symbol) == 0) {
-    return builtin_op(env, val, symbol);
-  }
+static void leval_cache_del(void *body) {
+  lval_del(body);
+}
 
-  if (strstr("+-/*^", symbol)) {
-    return builtin_op(env, val, symbol);
+/* The tree walker's "code" is just the folded body */
+static const lcache_ops_t leval_cache_ops = {
+  leval_cache_compile, leval_cache_retain, leval_cache_del
+};
+
+/* Turns an eval's Q-Expression, moved, into the S-Expression to evaluate,
+ * folded and cached like the compiled evaluators' bodies where it can be */
+static lval_t *leval_body(lenv_t *env, lval_t *expr) {
+  lval_t *body = lcache_get(expr, env, lval_apply, &leval_cache_ops);
+  if (body != NULL) {
+    lval_del(expr);
+    expr = body;
   }
 
-  lval_del(val);
+  expr = lval_unshare(expr);
+  expr->type = LVAL_SEXPR;
+  return expr;
+}
 
-  /* TODO: this error message should say which function was unknown */
-  return lval_err("Unknown function!");
+static int leval_is_tail_eval(lval_t *list) {
+  return list->count == 2
+    && lval_type(list->cell[0]) == LVAL_FUN
+    && list->cell[0]->builtin == builtin_eval
+    && lval_type(list->cell[1]) == LVAL_QEXPR;
+}
+
+/* Evaluates with a stack of frames rather than by recursion, so nesting is
+ * only limited by memory. A call to eval that is the last thing a frame does
+ * evaluates its argument in place of the frame, which lets chains of evals
+ * run in constant space. */
+lval_t *lval_eval(lenv_t *env, lval_t *val) {
+  leval_frame_t small[LEVAL_STACK_SIZE];
+  leval_frame_t *frames = small;
+  int capacity = LEVAL_STACK_SIZE;
+  int depth = 0;
+  int tailCalled = 0;
+
+  while (1) {
+    /* Go down to the first child that isn't an S-Expression */
+    while (lval_type(val) == LVAL_SEXPR) {
+      /* Evaluation rewrites the children in place */
+      val = lval_unshare(val);
+
+      /* Empty expressions are their own value */
+      if (val->count == 0) {
+        break;
+      }
+
+      if (depth == capacity) {
+        leval_frame_t *grown = lalloc_raw(sizeof(leval_frame_t) * capacity * 2);
+        memcpy(grown, frames, sizeof(leval_frame_t) * capacity);
+
+        if (frames != small) {
+          lalloc_raw_free(frames, sizeof(leval_frame_t) * capacity);
+        }
+
+        frames = grown;
+        capacity *= 2;
+      }
+
+      frames[depth].list = val;
+      frames[depth].next = 0;
+      depth++;
+
+      val = val->cell[0];
+    }
+
+    if (lval_type(val) == LVAL_SYM) {
+      lval_t *resolvedVal = lenv_get(env, val);
+      lval_del(val);
+      val = resolvedVal;
+    }
+
+    /* Hand val up, applying each list once its last child is done */
+    while (1) {
+      if (depth == 0) {
+        if (frames != small) {
+          lalloc_raw_free(frames, sizeof(leval_frame_t) * capacity);
+        }
+
+        /* The evals that were skipped never went through lval_apply() */
+        if (tailCalled && lalloc_quota_exceeded() && lval_type(val) != LVAL_ERR) {
+          lval_del(val);
+          return lval_err("Memory quota exceeded!");
+        }
+
+        return val;
+      }
+
+      leval_frame_t *frame = &frames[depth - 1];
+      lval_t *list = frame->list;
+      list->cell[frame->next] = val;
+
+      /* Check for errors */
+      if (lval_type(val) == LVAL_ERR) {
+        val = lval_take(list, frame->next);
+        depth--;
+        continue;
+      }
+
+      if (++frame->next < list->count) {
+        val = list->cell[frame->next];
+        break;
+      }
+
+      depth--;
+
+      if (leval_is_tail_eval(list)) {
+        lbuiltin caller = lcensus_enter(builtin_eval);
+        val = leval_body(env, lval_take(list, 1));
+        lcensus_leave(caller);
+
+        tailCalled = 1;
+        break;
+      }
+
+      val = lval_apply(env, list);
+    }
+  }
 }
 
 lval_t *builtin_add(lenv_t *env, lval_t *val) {
-  return builtin_op(env, val, "+");
+  return builtin_op(env, val, LOP_ADD);
 }
 
 lval_t *builtin_sub(lenv_t *env, lval_t *val) {
-  return builtin_op(env, val, "-");
+  return builtin_op(env, val, LOP_SUB);
 }
 
 lval_t *builtin_mul(lenv_t *env, lval_t *val) {
-  return builtin_op(env, val, "*");
+  return builtin_op(env, val, LOP_MUL);
 }
 
 lval_t *builtin_div(lenv_t *env, lval_t *val) {
-  return builtin_op(env, val, "/");
+  return builtin_op(env, val, LOP_DIV);
+}
+
+lval_t *builtin_min(lenv_t *env, lval_t *val) {
+  return builtin_op(env, val, LOP_MIN);
+}
+
+lval_t *builtin_max(lenv_t *env, lval_t *val) {
+  return builtin_op(env, val, LOP_MAX);
 }
 
-lval_t *builtin_op(lenv_t *env, lval_t *val, char *op) {
+lval_t *builtin_op(lenv_t *env, lval_t *val, lop_t op) {
   /* Ensure all arguments are numbers */
   for (int i = 0; i < val->count; i++) {
-    if (val->cell[i]->type != LVAL_NUM) {
+    if (lval_type(val->cell[i]) != LVAL_NUM) {
       lval_del(val);
       return lval_err("Cannot operate on non-number!");
     }
   }
 
-  lval_t *computedVal = lval_pop(val, 0);
+  /* Operands are read in place rather than popped, so the arithmetic itself
+   * never touches the heap. Each operator gets a loop of its own. */
+  lval_t **args = val->cell;
+  long computed = lval_num_value(args[0]);
 
-  /* If no arguments and operation is subtraction, simply negate the number */
-  if ((strcmp(op, "-") == 0) && val->count == 0) {
-    computedVal->num = (0 - computedVal->num);
-  }
+  switch (op) {
+    case LOP_ADD:
+      for (int i = 1; i < val->count; i++) {
+        computed += lval_num_value(args[i]);
+      }
+      break;
 
-  while (val->count > 0) {
-    lval_t *nextArg = lval_pop(val, 0);
+    case LOP_SUB:
+      /* If no arguments and operation is subtraction, simply negate the number */
+      if (val->count == 1) {
+        computed = (0 - computed);
+      }
 
-    if (strcmp(op, "min") == 0) { computedVal->num = MIN(computedVal->num, nextArg->num); }
-    if (strcmp(op, "max") == 0) { computedVal->num = MAX(computedVal->num, nextArg->num); }
+      for (int i = 1; i < val->count; i++) {
+        computed -= lval_num_value(args[i]);
+      }
+      break;
 
-    if (strcmp(op, "+") == 0) { computedVal->num += nextArg->num; }
-    if (strcmp(op, "-") == 0) { computedVal->num -= nextArg->num; }
-    if (strcmp(op, "*") == 0) { computedVal->num *= nextArg->num; }
+    case LOP_MUL:
+      for (int i = 1; i < val->count; i++) {
+        computed *= lval_num_value(args[i]);
+      }
+      break;
 
-    if (strcmp(op, "/") == 0) {
-      if (nextArg->num == 0) {
-        lval_del(computedVal);
-        lval_del(nextArg);
-        computedVal = lval_err("Division By Zero!");
-        break;
+    case LOP_DIV:
+      for (int i = 1; i < val->count; i++) {
+        long nextArg = lval_num_value(args[i]);
+
+        if (nextArg == 0) {
+          lval_del(val);
+          return lval_err("Division By Zero!");
+        }
+
+        computed /= nextArg;
       }
+      break;
 
-      computedVal->num /= nextArg->num;
-    }
+    case LOP_MIN:
+      for (int i = 1; i < val->count; i++) {
+        computed = MIN(computed, lval_num_value(args[i]));
+      }
+      break;
 
-    lval_del(nextArg);
+    case LOP_MAX:
+      for (int i = 1; i < val->count; i++) {
+        computed = MAX(computed, lval_num_value(args[i]));
+      }
+      break;
   }
 
   lval_del(val);
-  return computedVal;
+  return lval_num(computed);
 }
 
 lval_t *builtin_head(lenv_t *env, lval_t *val) {
@@ -360,14 +593,8 @@ lval_t *builtin_head(lenv_t *env, lval_t *val) {
   LASSERT_ARG_TYPE(val, "head", 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY(val, "head", 0);
 
-  lval_t *qexpr = lval_take(val, 0);
-
-  /* Delete all but the first argument */
-  while (qexpr->count > 1) {
-    lval_del(lval_pop(qexpr, 1));
-  }
-
-  return qexpr;
+  /* Keep just the first item */
+  return lval_slice(lval_take(val, 0), 0, 1);
 }
 
 lval_t *builtin_tail(lenv_t *env, lval_t *val) {
@@ -375,12 +602,9 @@ lval_t *builtin_tail(lenv_t *env, lval_t *val) {
   LASSERT_ARG_TYPE(val, "tail", 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY(val, "tail", 0);
 
+  /* Drop the first item */
   lval_t *qexpr = lval_take(val, 0);
-
-  /* Delete the first argument */
-  lval_del(lval_pop(qexpr, 0));
-
-  return qexpr;
+  return lval_slice(qexpr, 1, qexpr->count - 1);
 }
 
 /* TODO: should this only operate on S-Expessions? */
@@ -394,8 +618,34 @@ lval_t *builtin_eval(lenv_t *env, lval_t *val) {
   LASSERT_ARG_TYPE(val, "eval", 0, LVAL_QEXPR);
 
   lval_t *expr = lval_take(val, 0);
-  expr->type = LVAL_SEXPR;
-  return lval_eval(env, expr);
+
+  if (evaluator == EVAL_CLOSURES) {
+    lclos_code_t *code = lclos_compile_cached(expr, env, lval_apply);
+    if (code == NULL) {
+      code = lclos_compile(expr);
+    }
+
+    lval_del(expr);
+
+    lval_t *result = lclos_run(code, env, lval_apply, builtin_eval);
+    lclos_code_del(code);
+    return result;
+  }
+
+  if (evaluator == EVAL_VM) {
+    lvm_code_t *code = lvm_compile_cached(expr, env, lval_apply);
+    if (code == NULL) {
+      code = lvm_compile(expr);
+    }
+
+    lval_del(expr);
+
+    lval_t *result = lvm_run(code, env, lval_apply, builtin_eval);
+    lvm_code_del(code);
+    return result;
+  }
+
+  return lval_eval(env, leval_body(env, expr));
 }
 
 lval_t *builtin_join(lenv_t *env, lval_t *val) {
@@ -416,12 +666,9 @@ lval_t *builtin_cons(lenv_t *env, lval_t *val) {
   LASSERT_NUM_ARGS(val, "cons", 2);
   LASSERT_ARG_TYPE(val, "cons", 0, LVAL_QEXPR);
 
-  /* Create a list containing the second arg */
-  lval_t *qexpr = lval_qexpr();
-  lval_add(qexpr, val->cell[1]);
-
-  /* Join the new list to the front of the first arg */
-  return lval_join(qexpr, val->cell[0]);
+  /* Put the second arg on the front of the first */
+  lval_t *x = lval_pop(val, 1);
+  return lval_cons(x, lval_take(val, 0));
 }
 
 lval_t *builtin_len(lenv_t *env, lval_t *val) {
@@ -440,7 +687,7 @@ lval_t *builtin_init(lenv_t *env, lval_t *val) {
   lval_t *qexpr = lval_take(val, 0);
 
   if (qexpr->count > 0) {
-    lval_del(lval_pop(qexpr, qexpr->count - 1));
+    qexpr = lval_slice(qexpr, 0, qexpr->count - 1);
   }
 
   return qexpr;
@@ -453,7 +700,7 @@ lval_t *builtin_def(lenv_t *env, lval_t *val) {
   /* Ensure all items in first argument are symbols */
   lval_t *symbols = val->cell[0];
   for (int i = 0; i < symbols->count; i++) {
-    LASSERT(val, symbols->cell[i]->type == LVAL_SYM,
+    LASSERT(val, lval_type(symbols->cell[i]) == LVAL_SYM,
         "Function 'def' cannot define non-symbol");
   }
 
@@ -461,34 +708,201 @@ lval_t *builtin_def(lenv_t *env, lval_t *val) {
   LASSERT(val, symbols->count == (val->count - 1),
       "Number of values must match number of symbols in 'def'");
 
-  /* Store the values in the environment */
+  /* Move the values into the environment, in order so later duplicates win */
+  symbols = lval_pop(val, 0);
   for (int i = 0; i < symbols->count; i++) {
-    lenv_put(env, symbols->cell[i], val->cell[i + 1]);
+    lenv_put_move(env, symbols->cell[i]->sym, lval_pop(val, 0));
   }
 
+  lval_del(symbols);
   lval_del(val);
   return lval_sexpr();
 }
 
+lval_t *builtin_gc_stats(lenv_t *env, lval_t *val) {
+  lgc_stats_t stats = lgc_stats();
+  lval_del(val);
+
+  lval_t *qexpr = lval_qexpr();
+  lval_add(qexpr, lval_sym("collections"));
+  lval_add(qexpr, lval_num(stats.collections));
+  lval_add(qexpr, lval_sym("promoted"));
+  lval_add(qexpr, lval_num(stats.promoted));
+  lval_add(qexpr, lval_sym("pause-total-us"));
+  lval_add(qexpr, lval_num(stats.pauseTotalNs / 1000));
+  lval_add(qexpr, lval_sym("pause-max-us"));
+  lval_add(qexpr, lval_num(stats.pauseMaxNs / 1000));
+  lval_add(qexpr, lval_sym("nursery-bytes"));
+  lval_add(qexpr, lval_num(stats.nurseryUsed));
+  return qexpr;
+}
+
+lval_t *builtin_hcons_stats(lenv_t *env, lval_t *val) {
+  lhcons_stats_t stats = lhcons_stats();
+  lval_del(val);
+
+  lval_t *qexpr = lval_qexpr();
+  lval_add(qexpr, lval_sym("lookups"));
+  lval_add(qexpr, lval_num(stats.lookups));
+  lval_add(qexpr, lval_sym("hits"));
+  lval_add(qexpr, lval_num(stats.hits));
+  lval_add(qexpr, lval_sym("nodes"));
+  lval_add(qexpr, lval_num(stats.nodes));
+  lval_add(qexpr, lval_sym("bytes-saved"));
+  lval_add(qexpr, lval_num(stats.bytesSaved));
+  return qexpr;
+}
+
+lval_t *builtin_alloc_stats(lenv_t *env, lval_t *val) {
+  lalloc_stats_t stats = lalloc_stats();
+  lalloc_array_stats_t arrays = lalloc_array_stats();
+  lalloc_usage_t usage = lalloc_usage();
+  lval_del(val);
+
+  lval_t *qexpr = lval_qexpr();
+  lval_add(qexpr, lval_sym("allocs"));
+  lval_add(qexpr, lval_num(stats.allocs));
+  lval_add(qexpr, lval_sym("frees"));
+  lval_add(qexpr, lval_num(stats.frees));
+  lval_add(qexpr, lval_sym("pages"));
+  lval_add(qexpr, lval_num(stats.pages));
+  lval_add(qexpr, lval_sym("array-allocs"));
+  lval_add(qexpr, lval_num(arrays.allocs));
+  lval_add(qexpr, lval_sym("array-reused"));
+  lval_add(qexpr, lval_num(arrays.reused));
+  lval_add(qexpr, lval_sym("array-frees"));
+  lval_add(qexpr, lval_num(arrays.frees));
+  lval_add(qexpr, lval_sym("array-cached-bytes"));
+  lval_add(qexpr, lval_num(arrays.cachedBytes));
+  lval_add(qexpr, lval_sym("live-bytes"));
+  lval_add(qexpr, lval_num(usage.live));
+  lval_add(qexpr, lval_sym("peak-bytes"));
+  lval_add(qexpr, lval_num(usage.peak));
+  lval_add(qexpr, lval_sym("quota-bytes"));
+  lval_add(qexpr, lval_num(usage.quota));
+  lval_add(qexpr, lval_sym("quota-exceeded"));
+  lval_add(qexpr, lval_num(usage.exceeded));
+  return qexpr;
+}
+
+lval_t *builtin_heap_stats(lenv_t *env, lval_t *val) {
+  lval_del(val);
+
+  /* Take the numbers before building the report changes them */
+  lcensus_row_t rows[LVAL_QEXPR + 1];
+  for (lval_type_t type = LVAL_ERR; type <= LVAL_QEXPR; type++) {
+    rows[type] = lcensus_type(type);
+  }
+
+  lcensus_row_t cells = lcensus_cells();
+  lcensus_row_t regions = lcensus_regions();
+  size_t envBytes = lcensus_env_bytes(env);
+
+  const lcensus_site_t *sites;
+  size_t count = lcensus_sites(&sites);
+
+  lcensus_site_t *snapshot = lalloc_raw(sizeof(lcensus_site_t) * count);
+  memcpy(snapshot, sites, sizeof(lcensus_site_t) * count);
+
+  lval_t *types = lval_qexpr();
+  for (lval_type_t type = LVAL_ERR; type <= LVAL_QEXPR; type++) {
+    lval_t *entry = lval_qexpr();
+    lval_add(entry, lval_sym(lval_type_desc(type)));
+    lval_add(entry, lval_num(rows[type].count));
+    lval_add(entry, lval_num(rows[type].bytes));
+    lval_add(types, entry);
+  }
+
+  /* Every site with something still live, as {ctor caller type count bytes} */
+  lval_t *live = lval_qexpr();
+  for (size_t i = 0; i < count; i++) {
+    if (snapshot[i].live.count == 0) {
+      continue;
+    }
+
+    lval_t *entry = lval_qexpr();
+    lval_add(entry, lval_sym(snapshot[i].ctor));
+    lval_add(entry, lval_sym(lcensus_caller_name(snapshot[i].caller)));
+    lval_add(entry, lval_sym(lval_type_desc(snapshot[i].type)));
+    lval_add(entry, lval_num(snapshot[i].live.count));
+    lval_add(entry, lval_num(snapshot[i].live.bytes));
+    lval_add(live, entry);
+  }
+
+  lalloc_raw_free(snapshot, sizeof(lcensus_site_t) * count);
+
+  lval_t *qexpr = lval_qexpr();
+  lval_add(qexpr, lval_sym("types"));
+  lval_add(qexpr, types);
+  lval_add(qexpr, lval_sym("cell-blocks"));
+  lval_add(qexpr, lval_num(cells.count));
+  lval_add(qexpr, lval_sym("cell-bytes"));
+  lval_add(qexpr, lval_num(cells.bytes));
+  lval_add(qexpr, lval_sym("regions"));
+  lval_add(qexpr, lval_num(regions.count));
+  lval_add(qexpr, lval_sym("region-bytes"));
+  lval_add(qexpr, lval_num(regions.bytes));
+  lval_add(qexpr, lval_sym("env-bytes"));
+  lval_add(qexpr, lval_num(envBytes));
+  lval_add(qexpr, lval_sym("sites"));
+  lval_add(qexpr, live);
+  return qexpr;
+}
+
+lval_t *builtin_fold_stats(lenv_t *env, lval_t *val) {
+  lfold_stats_t stats = lfold_stats();
+  lval_del(val);
+
+  lval_t *qexpr = lval_qexpr();
+  lval_add(qexpr, lval_sym("passes"));
+  lval_add(qexpr, lval_num(stats.passes));
+  lval_add(qexpr, lval_sym("skipped"));
+  lval_add(qexpr, lval_num(stats.skipped));
+  lval_add(qexpr, lval_sym("folded"));
+  lval_add(qexpr, lval_num(stats.folded));
+  return qexpr;
+}
+
 void lenv_add_builtin(lenv_t *env, char *name, lbuiltin fun) {
-  lval_t *key = lval_sym(name);
+  lcensus_name(fun, name);
+  lenv_put_move(env, lsym_intern(name), lval_fun(fun));
+}
+
+void lenv_add_nullary_builtin(lenv_t *env, char *name, lbuiltin fun) {
+  lcensus_name(fun, name);
   lval_t *val = lval_fun(fun);
-  lenv_put(env, key, val);
-  lval_del(key);
-  lval_del(val);
+  val->nullary = 1;
+  lenv_put_move(env, lsym_intern(name), val);
+}
+
+/* Builtins without side effects, whose calls lfold() may evaluate early */
+void lenv_add_pure_builtin(lenv_t *env, char *name, lbuiltin fun) {
+  lenv_add_builtin(env, name, fun);
+  lfold_pure(fun);
 }
 
 void lenv_add_builtins(lenv_t *env) {
-  lenv_add_builtin(env, "list", builtin_list);
-  lenv_add_builtin(env, "head", builtin_head);
-  lenv_add_builtin(env, "tail", builtin_tail);
+  lenv_add_pure_builtin(env, "list", builtin_list);
+  lenv_add_pure_builtin(env, "head", builtin_head);
+  lenv_add_pure_builtin(env, "tail", builtin_tail);
   lenv_add_builtin(env, "eval", builtin_eval);
-  lenv_add_builtin(env, "join", builtin_join);
-
-  lenv_add_builtin(env, "+", builtin_add);
-  lenv_add_builtin(env, "-", builtin_sub);
-  lenv_add_builtin(env, "*", builtin_mul);
-  lenv_add_builtin(env, "/", builtin_div);
+  lenv_add_pure_builtin(env, "join", builtin_join);
+  lenv_add_pure_builtin(env, "cons", builtin_cons);
+  lenv_add_pure_builtin(env, "len", builtin_len);
+  lenv_add_pure_builtin(env, "init", builtin_init);
+
+  lenv_add_pure_builtin(env, "+", builtin_add);
+  lenv_add_pure_builtin(env, "-", builtin_sub);
+  lenv_add_pure_builtin(env, "*", builtin_mul);
+  lenv_add_pure_builtin(env, "/", builtin_div);
+  lenv_add_pure_builtin(env, "min", builtin_min);
+  lenv_add_pure_builtin(env, "max", builtin_max);
 
   lenv_add_builtin(env, "def", builtin_def);
+
+  lenv_add_nullary_builtin(env, "gc-stats", builtin_gc_stats);
+  lenv_add_nullary_builtin(env, "hcons-stats", builtin_hcons_stats);
+  lenv_add_nullary_builtin(env, "alloc-stats", builtin_alloc_stats);
+  lenv_add_nullary_builtin(env, "heap-stats", builtin_heap_stats);
+  lenv_add_nullary_builtin(env, "fold-stats", builtin_fold_stats);
 }
@@ -0,0 +1,154 @@
+/*
+ * Randomized model test for the hash table environment in lval.c.
+ *
+ * A pool of symbols is bound, rebound and removed at random, alongside a
+ * plain array of what each should be bound to, and after every step each
+ * symbol is looked up and checked against the array. Before that, symbols
+ * whose home slots are the last ones of a fresh table are bound, so their
+ * probe runs wrap around to the front, and removed again one at a time, so
+ * backward-shift deletion has to move entries back across the end. Numbers
+ * are kept outside the fixnum range so the sanitizers catch any reference
+ * that is dropped twice or never.
+ *
+ * Usage: env [seed] [steps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../lval.h"
+#include "../lsym.h"
+
+#define SYMBOLS 300
+
+/* Symbols bound at once in the wraparound phase, which keeps a fresh table
+ * of 16 slots from growing */
+#define WRAPPED 7
+
+/* Every number stored is this much above its position in the sequence */
+#define BOXED (LVAL_FIXNUM_MAX + 1)
+
+static lval_t *keys[SYMBOLS];
+static long models[SYMBOLS]; /* -1 while unbound */
+
+static void check(lenv_t *env, const char *when) {
+  int count = 0;
+
+  for (int i = 0; i < SYMBOLS; i++) {
+    lval_t *val = lenv_borrow(env, keys[i]->sym);
+    int ok = models[i] < 0 ? val == NULL
+      : val != NULL && lval_num_value(val) - BOXED == models[i];
+
+    if (!ok) {
+      fprintf(stderr, "%s: %s doesn't match its model\n", when, keys[i]->sym);
+      exit(1);
+    }
+
+    count += models[i] >= 0;
+  }
+
+  if (env->count != count) {
+    fprintf(stderr, "%s: %d bindings, expected %d\n", when, env->count, count);
+    exit(1);
+  }
+}
+
+static void put(lenv_t *env, int i, long next) {
+  lval_t *val = lval_num(BOXED + next);
+  lenv_put(env, keys[i], val);
+  lval_del(val);
+  models[i] = next;
+}
+
+/* How many bound entries sit before their home slot, having wrapped */
+static int wrapped(lenv_t *env) {
+  int count = 0;
+
+  for (int slot = 0; slot < env->capacity; slot++) {
+    const char *sym = env->entries[slot].sym;
+    if (sym != NULL && (size_t) slot < (lsym_hash(sym) & (env->capacity - 1))) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+int main(int argc, char **argv) {
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+  int steps = argc > 2 ? atoi(argv[2]) : 200000;
+  long next = 0;
+
+  lenv_t *env = lenv_new();
+
+  /* Name the first few symbols after ones that land on the last two slots */
+  int count = 0;
+  for (int n = 0; count < SYMBOLS; n++) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%d", count < WRAPPED ? "w" : "s", n);
+
+    unsigned long home = lsym_hash(lsym_intern(name)) & (env->capacity - 1);
+    if (count < WRAPPED && home < (unsigned long) env->capacity - 2) {
+      continue;
+    }
+
+    keys[count] = lval_sym(name);
+    models[count] = -1;
+    count++;
+  }
+
+  for (int i = 0; i < WRAPPED; i++) {
+    put(env, i, next++);
+  }
+
+  if (wrapped(env) == 0) {
+    fprintf(stderr, "wraparound: no entry wrapped around\n");
+    return 1;
+  }
+
+  check(env, "wraparound");
+
+  /* Remove in a random order, so holes open up on either side of the end */
+  for (int left = WRAPPED; left > 0; left--) {
+    int k = rand() % left;
+    int i = 0;
+
+    while (models[i] < 0 || k-- > 0) {
+      i++;
+    }
+
+    if (!lenv_remove(env, keys[i])) {
+      fprintf(stderr, "wraparound: %s wasn't removed\n", keys[i]->sym);
+      return 1;
+    }
+
+    models[i] = -1;
+    check(env, "wraparound");
+  }
+
+  for (int step = 0; step < steps; step++) {
+    int i = rand() % SYMBOLS;
+    char when[32];
+    snprintf(when, sizeof(when), "step %d", step);
+
+    if (rand() % 3 == 0) {
+      if (lenv_remove(env, keys[i]) != (models[i] >= 0)) {
+        fprintf(stderr, "%s: removing %s said otherwise\n", when, keys[i]->sym);
+        return 1;
+      }
+
+      models[i] = -1;
+    } else {
+      put(env, i, next++);
+    }
+
+    check(env, when);
+  }
+
+  for (int i = 0; i < SYMBOLS; i++) {
+    lval_del(keys[i]);
+  }
+
+  lenv_del(env);
+  return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Randomized model test for the persistent list operations in lval.c.
+ *
+ * A handful of lists are kept alongside plain arrays of what they should
+ * hold. Each step picks an operation at random, applies it both to a list
+ * (through a new reference, so older versions stay live and shared) and to
+ * the matching array, stores the result over a random slot, and checks
+ * every list against its array. Numbers are kept outside the fixnum range
+ * so each child is a reference counted node, which lets the sanitizers catch
+ * any reference that is dropped twice or never.
+ *
+ * Usage: lists [seed] [steps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lval.h"
+
+#define LISTS 16
+#define MAX_LENGTH 2000
+
+/* Every number stored is this much above its position in the sequence */
+#define BOXED (LVAL_FIXNUM_MAX + 1)
+
+typedef struct {
+  long *items;
+  int count;
+} model_t;
+
+static lval_t *lists[LISTS];
+static model_t models[LISTS];
+
+static model_t model_copy(model_t model, int extra) {
+  model_t copy = { malloc(sizeof(long) * (model.count + extra + 1)), model.count };
+  memcpy(copy.items, model.items, sizeof(long) * model.count);
+  return copy;
+}
+
+static void model_remove(model_t *model, int i) {
+  memmove(&model->items[i], &model->items[i + 1],
+      sizeof(long) * (model->count - i - 1));
+  model->count--;
+}
+
+static void check(int step, int i) {
+  lval_t *list = lists[i];
+  model_t *model = &models[i];
+  int ok = list->count == model->count;
+
+  for (int k = 0; ok && k < model->count; k++) {
+    ok = lval_num_value(list->cell[k]) - BOXED == model->items[k];
+  }
+
+  if (!ok) {
+    fprintf(stderr, "step %d: list %d doesn't match its model\n", step, i);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+  int steps = argc > 2 ? atoi(argv[2]) : 200000;
+  long next = 0;
+
+  for (int i = 0; i < LISTS; i++) {
+    lists[i] = lval_qexpr();
+    models[i] = (model_t) { malloc(sizeof(long)), 0 };
+  }
+
+  for (int step = 0; step < steps; step++) {
+    int a = rand() % LISTS;
+    int b = rand() % LISTS;
+    lval_t *list;
+    model_t model;
+
+    switch (rand() % 9) {
+      case 0: /* cons onto a shared list */
+        model = model_copy(models[a], 1);
+        memmove(&model.items[1], model.items, sizeof(long) * model.count);
+        model.items[0] = next;
+        model.count++;
+        list = lval_cons(lval_num(BOXED + next++), lval_copy(lists[a]));
+        break;
+
+      case 1: /* join two shared lists */
+        model = model_copy(models[a], models[b].count);
+        memcpy(&model.items[model.count], models[b].items, sizeof(long) * models[b].count);
+        model.count += models[b].count;
+        list = lval_join(lval_copy(lists[a]), lval_copy(lists[b]));
+        break;
+
+      case 2: /* tail */
+        if (models[a].count == 0) {
+          continue;
+        }
+
+        model = model_copy(models[a], 0);
+        model_remove(&model, 0);
+        list = lval_slice(lval_copy(lists[a]), 1, lists[a]->count - 1);
+        break;
+
+      case 3: /* init */
+        if (models[a].count == 0) {
+          continue;
+        }
+
+        model = model_copy(models[a], 0);
+        model.count--;
+        list = lval_slice(lval_copy(lists[a]), 0, lists[a]->count - 1);
+        break;
+
+      case 4: /* add to a private copy */
+        model = model_copy(models[a], 1);
+        model.items[model.count++] = next;
+        list = lval_unshare(lval_copy(lists[a]));
+        lval_add(list, lval_num(BOXED + next++));
+        break;
+
+      case 5: /* pop the head of a private copy */
+        if (models[a].count == 0) {
+          continue;
+        }
+
+        model = model_copy(models[a], 0);
+        model_remove(&model, 0);
+        list = lval_unshare(lval_copy(lists[a]));
+        lval_del(lval_pop(list, 0));
+        break;
+
+      case 6: { /* take one child */
+        if (models[a].count == 0) {
+          continue;
+        }
+
+        int k = rand() % models[a].count;
+        model = (model_t) { malloc(sizeof(long)), 1 };
+        model.items[0] = models[a].items[k];
+        list = lval_qexpr();
+        lval_add(list, lval_take(lval_copy(lists[a]), k));
+        break;
+      }
+
+      case 7: /* tail then cons on a list nobody else holds */
+        model = models[a];
+        list = lists[a];
+        lists[a] = lval_qexpr();
+        models[a] = (model_t) { malloc(sizeof(long)), 0 };
+
+        if (model.count > 0) {
+          list = lval_slice(list, 1, list->count - 1);
+          model_remove(&model, 0);
+        }
+
+        model.items = realloc(model.items, sizeof(long) * (model.count + 1));
+        memmove(&model.items[1], model.items, sizeof(long) * model.count);
+        model.items[0] = next;
+        model.count++;
+        list = lval_cons(lval_num(BOXED + next++), list);
+        break;
+
+      default: { /* pop from the middle of a private copy */
+        if (models[a].count < 3) {
+          continue;
+        }
+
+        int k = 1 + rand() % (models[a].count - 2);
+        model = model_copy(models[a], 0);
+        model_remove(&model, k);
+        list = lval_unshare(lval_copy(lists[a]));
+        lval_del(lval_pop(list, k));
+        break;
+      }
+    }
+
+    if (model.count > MAX_LENGTH) {
+      lval_del(list);
+      free(model.items);
+      continue;
+    }
+
+    int dest = rand() % LISTS;
+    lval_del(lists[dest]);
+    free(models[dest].items);
+    lists[dest] = list;
+    models[dest] = model;
+
+    for (int i = 0; i < LISTS; i++) {
+      check(step, i);
+    }
+  }
+
+  for (int i = 0; i < LISTS; i++) {
+    lval_del(lists[i]);
+    free(models[i].items);
+  }
+
+  return 0;
+}
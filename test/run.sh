@@ -0,0 +1,170 @@
+#!/bin/sh
+#
+# Builds byol in each of its configurations and checks that the tree walker,
+# --vm and --closures all print exactly what test/regress.expected holds for
+# test/regress.in and survive deeply nested evals and lists, then runs the
+# list and environment model tests against the same build.
+#
+# Usage: test/run.sh [extra cflags...], e.g. test/run.sh -g -fsanitize=address
+#
+# CC, CFLAGS and LDLIBS are taken from the environment, as make passes them.
+
+set -e
+cd "$(dirname "$0")/.."
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--std=c11 -Wall}
+LDLIBS=${LDLIBS:--ledit -lm -lpthread}
+EXTRA="$*"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+SRCS=$(ls *.c)
+LIB_SRCS=$(ls *.c | grep -v -e '^main\.c$' -e '^mpc\.c$')
+
+failed=0
+
+check() {
+  if "$@" > "$TMP/diff" 2>&1; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    cat "$TMP/diff"
+    failed=1
+  fi
+}
+
+# Prompts only show up when a terminal is attached, depending on readline
+run_regress() {
+  "$TMP/byol" "$@" < test/regress.in 2>&1 | sed 's/byol> //g' > "$TMP/out"
+  diff -u test/regress.expected "$TMP/out"
+}
+
+# Each of 20k names evaluates the one before from inside a call, so nothing
+# is a tail eval. A small C stack makes any recursion on the depth fail.
+awk 'BEGIN {
+  print "def {a0} {+ 1 2}"
+  for (i = 1; i < 20000; i++) {
+    print "def {a" i "} {+ 1 (eval a" i - 1 ")}"
+  }
+  print "eval a19999"
+}' > "$TMP/nested.in"
+
+run_nested() {
+  out=$(ulimit -s 1024; "$TMP/byol" "$@" < "$TMP/nested.in" 2>&1 | sed 's/byol> //g' | grep -v '^$' | tail -n 1)
+  if [ "$out" != 20002 ]; then
+    echo "expected 20002, got $out"
+    return 1
+  fi
+}
+
+# A list nested 150k deep, stored and then read, so the environment compacts
+# it. Walking it by recursion would overflow the small C stack.
+awk 'BEGIN {
+  print "def {l} {}"
+  for (i = 0; i < 150000; i++) {
+    print "def {l} (cons {} l)"
+  }
+  print "len l"
+  print "len l"
+}' > "$TMP/deep.in"
+
+run_deep() {
+  out=$(ulimit -s 1024; "$TMP/byol" "$@" < "$TMP/deep.in" 2>&1 | sed 's/byol> //g' | grep -v '^$' | tail -n 1)
+  if [ "$out" != 1 ]; then
+    echo "expected 1, got $out"
+    return 1
+  fi
+}
+
+# What heap-stats reports for the environment has to be counted in time and
+# constant C stack. x ends up a list of two references to the x before, 34
+# levels down, so counting shared structure in full would take 2^34 steps.
+# l nests 60k deep and is read only once, so it is walked rather than
+# counted as a compacted region.
+awk 'BEGIN {
+  print "def {x} {1}"
+  for (i = 0; i < 34; i++) {
+    print "def {x} (join (list x) (list x))"
+  }
+  print "(heap-stats)"
+  print "len x"
+}' > "$TMP/stats-shared.in"
+
+awk 'BEGIN {
+  print "def {l} {}"
+  for (i = 0; i < 60000; i++) {
+    print "def {l} (cons {} l)"
+  }
+  print "(heap-stats)"
+  print "len l"
+}' > "$TMP/stats-deep.in"
+
+run_stats() {
+  out=$(ulimit -s 1024; timeout 20 "$TMP/byol" < "$1" 2>&1 | sed 's/byol> //g' | grep -v '^$' | tail -n 1)
+  if [ "$out" != "$2" ]; then
+    echo "expected $2, got $out"
+    return 1
+  fi
+}
+
+# Reading a binding that shares its structure must not copy it out. The
+# first (alloc-stats) interns the names it reports, so only the next two are
+# compared, around reads that would have compacted x.
+awk 'BEGIN {
+  print "def {x} {1}"
+  for (i = 0; i < 16; i++) {
+    print "def {x} (join (list x) (list x))"
+  }
+  print "(alloc-stats)"
+  print "(alloc-stats)"
+  print "len x"
+  print "len x"
+  print "len x"
+  print "(alloc-stats)"
+}' > "$TMP/reads.in"
+
+run_reads() {
+  live=$("$TMP/byol" < "$TMP/reads.in" 2>&1 | sed -n 's/.*live-bytes \([0-9]*\).*/\1/p' | tail -n 2)
+  set -- $live
+  if [ $# != 2 ] || [ "$1" != "$2" ]; then
+    echo "expected the same live bytes twice, got" $live
+    return 1
+  fi
+}
+
+# Builds with the given flags and runs everything against the build
+run_config() {
+  flags=${*:-default}
+  $CC $CFLAGS "$@" $EXTRA $SRCS -o "$TMP/byol" $LDLIBS
+  $CC $CFLAGS "$@" $EXTRA test/lists.c $LIB_SRCS -o "$TMP/lists" -lm -lpthread
+  $CC $CFLAGS "$@" $EXTRA test/env.c $LIB_SRCS -o "$TMP/env" -lm -lpthread
+
+  name="$flags tree";       check run_regress
+  name="$flags --vm";       check run_regress --vm
+  name="$flags --closures"; check run_regress --closures
+  name="$flags nested";     check run_nested
+  name="$flags nested --vm"; check run_nested --vm
+  name="$flags nested --closures"; check run_nested --closures
+  name="$flags deep";       check run_deep
+  name="$flags deep --vm";  check run_deep --vm
+  name="$flags deep --closures"; check run_deep --closures
+  name="$flags heap-stats shared"; check run_stats "$TMP/stats-shared.in" 2
+  name="$flags heap-stats deep"; check run_stats "$TMP/stats-deep.in" 1
+  name="$flags shared reads"; check run_reads
+  name="$flags lists";      check "$TMP/lists" 1 50000
+  name="$flags env";        check "$TMP/env" 1 50000
+}
+
+run_config
+run_config -DLGC
+run_config -DLGC_REGION
+run_config -DLHCONS
+run_config -DLHCONS -DLGC
+run_config -DLRECLAIM
+run_config -DLCENSUS
+run_config -DLALLOC_MALLOC
+run_config -DLALLOC_HUGE
+
+exit $failed